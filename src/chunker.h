@@ -0,0 +1,122 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <stdint.h>
+#include <vector>
+#include "protocol.h"
+#include "crc32c.h"
+
+/*
+    Content-defined chunking with a gear rolling hash. A boundary is cut
+    where the low CHUNK_AVG_BITS bits of the rolling hash are zero, so an
+    edit only changes the chunks around it and the rest of the file keeps
+    the same chunks on both sides.
+*/
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_AVG_BITS 13
+#define CHUNK_MAX (64 * 1024)
+
+/*
+    signature entry on the wire: 4 byte len, 8 byte hash, 4 byte crc. hash
+    names the chunk, crc32c is what the receiver checks the bytes against.
+*/
+#define SIG_SIZE 16
+
+struct CHUNK {
+    uint64_t off, hash;
+    uint32_t len, crc;
+};
+
+static inline void sig_put(char *dst, CHUNK& chunk) {
+    uint32_t net_len = htonl(chunk.len), net_crc = htonl(chunk.crc);
+    memcpy(dst, &net_len, 4);
+    put_u64(dst + 4, chunk.hash);
+    memcpy(dst + 12, &net_crc, 4);
+}
+
+static inline void sig_get(const char *src, CHUNK& chunk) {
+    uint32_t net_len, net_crc;
+    memcpy(&net_len, src, 4);
+    memcpy(&net_crc, src + 12, 4);
+    chunk.len = ntohl(net_len);
+    chunk.hash = get_u64(src + 4);
+    chunk.crc = ntohl(net_crc);
+    chunk.off = 0;
+}
+
+struct GEAR_TABLE {
+    uint64_t value[256];
+
+    GEAR_TABLE() {
+        uint64_t seed = 0x9e3779b97f4a7c15ull;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            this->value[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static inline const uint64_t *gear_table() {
+    static GEAR_TABLE table;
+    return table.value;
+}
+
+struct CHUNKER {
+    uint64_t gear, hash, off;
+    uint32_t len, crc;
+
+    CHUNKER() {
+        this->gear = 0;
+        this->hash = HASH_INIT;
+        this->off = 0;
+        this->len = 0;
+        this->crc = 0;
+    }
+};
+
+static inline void chunker_cut(CHUNKER& c, std::vector<CHUNK>& chunks) {
+    CHUNK chunk;
+    chunk.off = c.off;
+    chunk.len = c.len;
+    chunk.hash = c.hash;
+    chunk.crc = c.crc;
+    chunks.push_back(chunk);
+
+    c.off += c.len;
+    c.len = 0;
+    c.gear = 0;
+    c.hash = HASH_INIT;
+    c.crc = 0;
+}
+
+/*
+    Feeds the next piece of the file, every chunk completed by it is
+    appended to chunks.
+*/
+static inline void chunker_feed(CHUNKER& c, const char *data, size_t len, std::vector<CHUNK>& chunks) {
+    const uint64_t *gear = gear_table();
+    const uint64_t mask = (1ull << CHUNK_AVG_BITS) - 1;
+
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        c.gear = (c.gear << 1) + gear[(unsigned char)data[i]];
+        c.len++;
+        if ((c.len >= CHUNK_MIN && (c.gear & mask) == 0) || c.len == CHUNK_MAX) {
+            c.hash = hash_update(c.hash, data + start, i + 1 - start);
+            c.crc = crc32c_update(c.crc, data + start, i + 1 - start);
+            start = i + 1;
+            chunker_cut(c, chunks);
+        }
+    }
+    c.hash = hash_update(c.hash, data + start, len - start);
+    c.crc = crc32c_update(c.crc, data + start, len - start);
+}
+
+static inline void chunker_finish(CHUNKER& c, std::vector<CHUNK>& chunks) {
+    if (c.len > 0)
+        chunker_cut(c, chunks);
+}
+
+#endif
@@ -1,32 +1,40 @@
-#include <sys/select.h>
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <cstring>
 #include <vector>
 #include <algorithm>
-#include <queue>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <zlib.h>
+#include "event_loop.h"
+#include "protocol.h"
+#include "chunker.h"
 using namespace std;
 
 #define DEBUG
 
-#define BUF_SIZE 1024
 #define BACKLOG 20
+#define UPLOAD_MAX 4
+#define DEBOUNCE_MS 300
+#define DEBOUNCE_MAX_MS 3000
+#define SCAN_BUDGET (4 * 1024 * 1024)
 
-struct PACKAGE {
-    int mode, len;
-    char buf[BUF_SIZE];
-
-    PACKAGE() {
-        this->mode = -1;
-    }
-};
+#define TIMER_SLEEP 0
+#define TIMER_FLUSH 1
+#define TIMER_CNT 2
 
 void log_info(bool error, const char *msg) {
 #ifdef DEBUG
@@ -39,6 +47,834 @@ void log_info(bool error, const char *msg) {
 #endif
 }
 
+uint64_t now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct LOCAL_FILE {
+    string name;
+    uint64_t size, hash;
+};
+
+bool local_name(const char *name) {
+    return name[0] != '.' && strlen(name) < 30;
+}
+
+/*
+    Lists the names of the regular files in the working directory.
+*/
+void list_local(vector<string>& names) {
+    DIR *dir = opendir(".");
+    if (dir == NULL)
+        log_info(true, "[ERROR] opendir() error.\n");
+
+    dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (!local_name(ent->d_name))
+            continue;
+        if (stat(ent->d_name, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        names.push_back(ent->d_name);
+    }
+    closedir(dir);
+}
+
+/*
+    Lists the regular files in the working directory with their size and
+    content hash, the server uses it to skip files we already hold. Only
+    run before the loop starts.
+*/
+void build_manifest(vector<LOCAL_FILE>& manifest) {
+    vector<string> names;
+    list_local(names);
+
+    char chunk[BUF_SIZE * 64];
+    for (int i = 0; i < names.size(); i++) {
+        FILE *fp = fopen(names[i].c_str(), "rb");
+        if (fp == NULL)
+            continue;
+        LOCAL_FILE file;
+        file.name = names[i];
+        file.size = 0;
+        file.hash = HASH_INIT;
+        size_t len;
+        while ((len = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+            file.size += len;
+            file.hash = hash_update(file.hash, chunk, len);
+        }
+        fclose(fp);
+        manifest.push_back(file);
+    }
+}
+
+/*
+    A download cut short, kept as .NAME.SIZE.HASH.resume with the size and
+    hash of the version in hex, off is how much of it arrived and got_hash
+    the hash of those bytes.
+*/
+struct PARTIAL_FILE {
+    string name, path;
+    uint64_t size, hash, off, got_hash;
+};
+
+void resume_path(char *path, const char *name, uint64_t size, uint64_t hash) {
+    sprintf(path, ".%s.%016llx.%016llx.resume", name, (unsigned long long)size, (unsigned long long)hash);
+}
+
+/*
+    Hashes the first off bytes of fp, false if it is shorter.
+*/
+bool hash_prefix(FILE *fp, uint64_t off, uint64_t& hash) {
+    char chunk[BUF_SIZE * 64];
+    for (uint64_t left = off; left > 0;) {
+        size_t len = fread(chunk, 1, left < sizeof(chunk) ? left : sizeof(chunk), fp);
+        if (len == 0)
+            return false;
+        hash = hash_update(hash, chunk, len);
+        left -= len;
+    }
+    return true;
+}
+
+/*
+    Lists the resume files in the working directory and hashes what they
+    hold, like build_manifest only before the loop starts. Empty ones and
+    those that are not named like one are removed.
+*/
+void find_partials(vector<PARTIAL_FILE>& partials) {
+    DIR *dir = opendir(".");
+    if (dir == NULL)
+        log_info(true, "[ERROR] opendir() error.\n");
+
+    dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        int len = strlen(ent->d_name);
+        if (len < 43 || ent->d_name[0] != '.' || strcmp(ent->d_name + len - 7, ".resume"))
+            continue;
+
+        PARTIAL_FILE file;
+        char path[100];
+        unsigned long long size, hash;
+        struct stat st;
+        file.path = ent->d_name;
+        file.name.assign(ent->d_name + 1, len - 42);
+        bool named = sscanf(ent->d_name + len - 41, ".%16llx.%16llx.resume", &size, &hash) == 2 && file.name.size() < 30;
+        if (named)
+            resume_path(path, file.name.c_str(), size, hash);
+        if (!named || file.path != path || stat(path, &st) == -1 || st.st_size == 0 || (uint64_t)st.st_size >= size) {
+            unlink(ent->d_name);
+            continue;
+        }
+        file.size = size;
+        file.hash = hash;
+        file.off = st.st_size;
+        file.got_hash = HASH_INIT;
+        FILE *fp = fopen(path, "rb");
+        bool hashed = fp != NULL && hash_prefix(fp, file.off, file.got_hash);
+        if (fp != NULL)
+            fclose(fp);
+        if (hashed)
+            partials.push_back(file);
+    }
+    closedir(dir);
+}
+
+struct UPLOAD {
+    /*
+        state
+        0: idle
+        1: sending chunk signatures
+        2: waiting for the chunks the server is missing
+        3: sending the missing chunks
+        4: aborted, an empty mode 20 frame is still to be sent
+        5: reading the file and cutting it into chunks, chunker holds the
+           cut so far
+        6: read, the mode 1 frame is still to be queued
+    */
+    int state, fd, id;
+    char name[30];
+    bool force;
+    uint64_t size, hash;
+    CHUNKER chunker;
+    vector<CHUNK> chunks;
+    vector<uint32_t> need;
+    size_t sig_sent, need_idx;
+    uint32_t need_off;
+
+    /*
+        raw is the chunk at need_idx as read and checked against its crc,
+        packed the same chunk deflated while it goes out as mode 18 frames.
+        load_idx is the need_idx they were made for and misses counts the
+        chunks in a row that did not get smaller.
+    */
+    string raw, packed;
+    size_t load_idx;
+    int misses;
+
+    UPLOAD() {
+        this->state = 0;
+        this->fd = -1;
+        this->load_idx = SIZE_MAX;
+        this->misses = 0;
+    }
+};
+
+/*
+    A mode 16 download writes straight to its resume file and is checked
+    against hash when it ends, so a cut one is left where the next session
+    can pick it up.
+*/
+struct DOWNLOAD {
+    int id;
+    char name[30], tmp_name[100];
+    FILE *wr_fd;
+    int base_fd;
+    uint64_t size, hash, got_hash;
+    bool delta, resumable;
+
+    DOWNLOAD() {
+        this->wr_fd = NULL;
+        this->base_fd = -1;
+        this->delta = false;
+        this->resumable = false;
+    }
+};
+
+/*
+    Everything the client waits on goes through one edge-triggered loop:
+    the server socket, stdin, a timerfd and an inotify watch of the working
+    directory. Nothing in it blocks, so a /sleep or a burst of local changes
+    never holds up the transfers in flight, and files to upload are read a
+    budget at a time between the passes.
+*/
+struct CLIENT {
+    int fd, timer_fd, watch_fd;
+    EVENT_LOOP loop;
+    BUFFER in, out;
+    PACKAGE pkg;
+    uint32_t peer_frame;
+    bool can_write, exiting, deflate, peer_deflate;
+
+    /*
+        manifest and partials go out once after the username, synced is
+        the version of each local file the server is known to hold, a
+        change that leaves a file at that version is not uploaded again.
+    */
+    vector<LOCAL_FILE> manifest;
+    vector<PARTIAL_FILE> partials;
+    size_t manifest_sent, partial_sent;
+    bool manifest_done;
+    map<string, LOCAL_FILE> synced;
+
+    /*
+        refetch holds the names whose download did not match its hash and
+        that are still to be asked for again with mode 21, refetched the
+        ones already asked for, a second mismatch of those is only dropped.
+    */
+    deque<string> refetch;
+    set<string> refetched;
+
+    /*
+        puts holds the names waiting for one of the UPLOAD_MAX upload
+        slots, forced by /put or only if changed. A name already uploading
+        waits until that upload is done.
+    */
+    vector<UPLOAD *> uploads;
+    size_t rr;
+    int next_stream;
+    deque<string> puts;
+    map<string, bool> put_force;
+    map<int, DOWNLOAD *> downloads;
+    DOWNLOAD *seg;
+    uint64_t seg_left;
+
+    /*
+        words is what stdin typed so far split on whitespace, commands are
+        taken from its front once complete. A /sleep only pauses them, it
+        counts down on the timer.
+    */
+    string line;
+    deque<string> words;
+    bool stdin_open;
+    int sleep_total, sleep_done;
+
+    /*
+        deadline of each TIMER_*, 0 when off. Changed names wait in dirty
+        until the watch has been quiet for DEBOUNCE_MS, or DEBOUNCE_MAX_MS
+        after the first one for a file that keeps changing.
+    */
+    uint64_t deadline[TIMER_CNT];
+    set<string> dirty;
+    uint64_t dirty_since;
+
+    CLIENT() {
+        this->fd = -1;
+        this->timer_fd = -1;
+        this->watch_fd = -1;
+        this->peer_frame = BUF_SIZE;
+        this->can_write = true;
+        this->exiting = false;
+        this->deflate = true;
+        this->peer_deflate = false;
+        this->manifest_sent = 0;
+        this->partial_sent = 0;
+        this->manifest_done = false;
+        this->rr = 0;
+        this->next_stream = 1;
+        this->seg = NULL;
+        this->seg_left = 0;
+        this->stdin_open = true;
+        this->sleep_total = 0;
+        this->sleep_done = 0;
+        this->dirty_since = 0;
+        for (int i = 0; i < TIMER_CNT; i++)
+            this->deadline[i] = 0;
+    }
+};
+
+/*
+    Points the timerfd at the earliest deadline.
+*/
+void arm_timer(CLIENT& client) {
+    uint64_t next = 0;
+    for (int i = 0; i < TIMER_CNT; i++) {
+        if (client.deadline[i] != 0 && (next == 0 || client.deadline[i] < next))
+            next = client.deadline[i];
+    }
+
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (next != 0) {
+        spec.it_value.tv_sec = next / 1000;
+        spec.it_value.tv_nsec = next % 1000 * 1000000;
+    }
+    if (timerfd_settime(client.timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        log_info(true, "[ERROR] timerfd_settime() error.\n");
+}
+
+void set_timer(CLIENT& client, int timer, uint64_t at) {
+    client.deadline[timer] = at;
+    arm_timer(client);
+}
+
+/*
+    Opens the file of a put, scan_upload reads it before anything is sent.
+*/
+bool start_upload(UPLOAD& up, const char *name) {
+    up.fd = open(name, O_RDONLY);
+    if (up.fd == -1)
+        return false;
+
+    up.id = -1;
+    strcpy(up.name, name);
+    up.chunker = CHUNKER();
+    up.chunks.clear();
+    up.size = 0;
+    up.hash = HASH_INIT;
+    up.state = 5;
+    return true;
+}
+
+/*
+    Reads and cuts the file until it ends or budget runs out, size and hash
+    become those of the whole file. Returns true once the file ended.
+*/
+bool scan_upload(UPLOAD& up, uint64_t& budget) {
+    char chunk[BUF_SIZE * 64];
+    while (budget > 0) {
+        ssize_t len = read(up.fd, chunk, sizeof(chunk));
+        if (len <= 0) {
+            chunker_finish(up.chunker, up.chunks);
+            return true;
+        }
+        chunker_feed(up.chunker, chunk, len, up.chunks);
+        up.size += len;
+        up.hash = hash_update(up.hash, chunk, len);
+        budget -= budget < (uint64_t)len ? budget : len;
+    }
+    return false;
+}
+
+/*
+    Gives the read file its stream, the chunk signatures go out next.
+*/
+void begin_upload(UPLOAD& up, int id) {
+    up.id = id;
+    up.need.clear();
+    up.sig_sent = 0;
+    up.need_idx = 0;
+    up.need_off = 0;
+    up.state = 1;
+}
+
+/*
+    Reads the chunk at need_idx into up.raw and, with deflate, deflates it
+    into up.packed, left empty if it does not get smaller. Returns false if
+    the file no longer holds the bytes the signature was made from.
+*/
+bool load_chunk(UPLOAD& up, bool deflate) {
+    CHUNK& c = up.chunks[up.need[up.need_idx]];
+    up.load_idx = up.need_idx;
+    up.raw.resize(c.len);
+    up.packed.clear();
+    if (pread(up.fd, &up.raw[0], c.len, c.off) != c.len || crc32c_update(0, up.raw.data(), c.len) != c.crc)
+        return false;
+    if (!deflate || up.misses >= PACK_PROBE)
+        return true;
+
+    uLongf packed_len = compressBound(c.len);
+    up.packed.resize(packed_len);
+    if (compress2((Bytef *)&up.packed[0], &packed_len, (Bytef *)up.raw.data(), c.len, PACK_LEVEL) == Z_OK && pack_saves(packed_len, c.len)) {
+        up.packed.resize(packed_len);
+        up.misses = 0;
+    } else {
+        up.packed.clear();
+        up.misses++;
+    }
+    return true;
+}
+
+/*
+    Pushes the next piece of the upload into out, at most one segment of
+    chunk data in frames of up to frame bytes so the other uploads get
+    their turn. With deflate each chunk is tried deflated first and sent
+    as mode 18 if that saves enough, until PACK_PROBE chunks in a row did
+    not. Each chunk is read whole and checked before any of it goes out,
+    if the file changed since it was cut the upload is aborted instead.
+    Returns true once the closing frame or the mode 20 frame of an aborted
+    upload is queued.
+*/
+bool fill_upload(UPLOAD& up, BUFFER& out, uint32_t frame, bool deflate) {
+    char chunk[FRAME_MAX];
+    uint32_t queued = 0;
+
+    while (up.state == 1) {
+        if (up.sig_sent == up.chunks.size()) {
+            if (!frame_push(out, 8, up.id, "", 0))
+                return false;
+            up.state = 2;
+            break;
+        }
+
+        int cnt = 0;
+        for (; cnt < BUF_SIZE / SIG_SIZE && up.sig_sent + cnt < up.chunks.size(); cnt++) {
+            CHUNK& c = up.chunks[up.sig_sent + cnt];
+            sig_put(chunk + cnt * SIG_SIZE, c);
+        }
+        if (!frame_push(out, 7, up.id, chunk, cnt * SIG_SIZE))
+            return false;
+        up.sig_sent += cnt;
+    }
+
+    while (up.state == 3 && queued < SEGMENT_SIZE) {
+        if (up.need_idx == up.need.size()) {
+            if (!frame_push(out, 2, up.id, "", 0))
+                return false;
+            close(up.fd);
+            up.fd = -1;
+            up.state = 0;
+            return true;
+        }
+        CHUNK& c = up.chunks[up.need[up.need_idx]];
+        if (up.load_idx != up.need_idx && !load_chunk(up, deflate)) {
+            printf("[Upload] %s Changed!\n", up.name);
+            up.state = 4;
+            break;
+        }
+        if (!up.packed.empty()) {
+            uint32_t len = up.packed.size() - up.need_off < frame ? up.packed.size() - up.need_off : frame;
+            if (!frame_push(out, 18, up.id, up.packed.data() + up.need_off, len))
+                return false;
+            queued += HEADER_SIZE + len;
+            up.need_off += len;
+            if (up.need_off == up.packed.size()) {
+                up.packed.clear();
+                up.need_idx++;
+                up.need_off = 0;
+            }
+            continue;
+        }
+
+        uint32_t len = c.len - up.need_off < frame ? c.len - up.need_off : frame;
+        if (!frame_fits(out, len))
+            return false;
+
+        frame_push(out, 2, up.id, up.raw.data() + up.need_off, len);
+        queued += HEADER_SIZE + len;
+        up.need_off += len;
+        if (up.need_off == c.len) {
+            up.need_idx++;
+            up.need_off = 0;
+        }
+    }
+
+    if (up.state == 4) {
+        if (!frame_push(out, 20, up.id, "", 0))
+            return false;
+        close(up.fd);
+        up.fd = -1;
+        return true;
+    }
+    return false;
+}
+
+/*
+    Queues name for upload, a forced put is sent even if the server already
+    holds that version.
+*/
+void queue_put(CLIENT& client, const string& name, bool force) {
+    map<string, bool>::iterator it = client.put_force.find(name);
+    if (it != client.put_force.end()) {
+        it->second |= force;
+        return;
+    }
+    client.puts.push_back(name);
+    client.put_force[name] = force;
+}
+
+bool uploading(CLIENT& client, const string& name) {
+    for (int i = 0; i < client.uploads.size(); i++) {
+        if (name == client.uploads[i]->name)
+            return true;
+    }
+    return false;
+}
+
+/*
+    Starts queued puts while there are free upload slots. A name that is
+    still uploading keeps its place for the next round.
+*/
+void start_puts(CLIENT& client) {
+    if (!client.manifest_done)
+        return;
+    for (size_t i = 0; i < client.puts.size() && client.uploads.size() < UPLOAD_MAX;) {
+        string name = client.puts[i];
+        if (uploading(client, name)) {
+            i++;
+            continue;
+        }
+        bool force = client.put_force[name];
+        client.puts.erase(client.puts.begin() + i);
+        client.put_force.erase(name);
+
+        UPLOAD *up = new UPLOAD();
+        if (!start_upload(*up, name.c_str())) {
+            delete up;
+            continue;
+        }
+        up->force = force;
+        client.uploads.push_back(up);
+    }
+}
+
+/*
+    Reads the files of the started puts, SCAN_BUDGET bytes in all per loop
+    pass so a large file does not hold up the transfers in flight. A file
+    the server already holds is dropped once read, the others get their
+    mode 1 frame when out has room.
+*/
+void scan_uploads(CLIENT& client) {
+    uint64_t budget = SCAN_BUDGET;
+    for (size_t i = 0; i < client.uploads.size();) {
+        UPLOAD *up = client.uploads[i];
+        if (up->state == 5 && scan_upload(*up, budget)) {
+            map<string, LOCAL_FILE>::iterator held = client.synced.find(up->name);
+            if (!up->force && held != client.synced.end() && held->second.size == up->size && held->second.hash == up->hash) {
+                close(up->fd);
+                delete up;
+                client.uploads.erase(client.uploads.begin() + i);
+                continue;
+            }
+            up->state = 6;
+        }
+        if (up->state == 6 && frame_fits(client.out, strlen(up->name))) {
+            LOCAL_FILE& file = client.synced[up->name];
+            file.name = up->name;
+            file.size = up->size;
+            file.hash = up->hash;
+            begin_upload(*up, client.next_stream);
+            frame_push(client.out, 1, up->id, up->name, strlen(up->name));
+            client.next_stream += 2;
+
+            printf("[Upload] %s Start!\n", up->name);
+            printf("Progress : [######################]\n");
+        }
+        i++;
+    }
+}
+
+bool scanning(CLIENT& client) {
+    for (int i = 0; i < client.uploads.size(); i++) {
+        if (client.uploads[i]->state == 5)
+            return true;
+    }
+    return false;
+}
+
+void drop_download(DOWNLOAD& down) {
+    fclose(down.wr_fd);
+    unlink(down.tmp_name);
+    if (down.base_fd != -1)
+        close(down.base_fd);
+}
+
+/*
+    Installs the finished file and records it as synced, so the watch
+    event of the rename does not send it back. A delta or resumable
+    download that does not match its hash is dropped and the file is
+    asked for again in full, once.
+*/
+void finish_download(CLIENT& client, DOWNLOAD& down) {
+    fclose(down.wr_fd);
+    down.wr_fd = NULL;
+    if (down.delta) {
+        close(down.base_fd);
+        down.base_fd = -1;
+    }
+    if ((down.delta || down.resumable) && down.got_hash != down.hash) {
+        log_info(false, "[INFO] download hash mismatch. file dropped.\n");
+        unlink(down.tmp_name);
+        printf("[Download] %s Mismatch!\n", down.name);
+        if (client.refetched.insert(down.name).second)
+            client.refetch.push_back(down.name);
+        return;
+    }
+    rename(down.tmp_name, down.name);
+    client.refetched.erase(down.name);
+
+    LOCAL_FILE& file = client.synced[down.name];
+    file.name = down.name;
+    file.size = down.size;
+    file.hash = down.got_hash;
+    printf("[Download] %s Finish!\n", down.name);
+}
+
+UPLOAD *find_upload(vector<UPLOAD *>& uploads, int id) {
+    for (int i = 0; i < uploads.size(); i++) {
+        if (uploads[i]->id == id)
+            return uploads[i];
+    }
+    return NULL;
+}
+
+/*
+    Opens the resume file of a mode 16 download, keeping the first off
+    bytes the server skips so the whole file is checked at the end. Their
+    hash was taken by find_partials, they are only read again if the
+    offset is not the one reported.
+*/
+void open_resumable(DOWNLOAD& down, uint64_t off, vector<PARTIAL_FILE>& partials) {
+    resume_path(down.tmp_name, down.name, down.size, down.hash);
+    down.resumable = true;
+    if (off == 0) {
+        down.wr_fd = fopen(down.tmp_name, "wb");
+        return;
+    }
+
+    down.wr_fd = fopen(down.tmp_name, "r+b");
+    if (down.wr_fd == NULL || ftruncate(fileno(down.wr_fd), off) == -1)
+        log_info(true, "[ERROR] recv mode 16 error. cannot open resume file.\n");
+    bool known = false;
+    for (int i = 0; i < partials.size() && !known; i++) {
+        known = partials[i].path == down.tmp_name && partials[i].off == off;
+        if (known)
+            down.got_hash = partials[i].got_hash;
+    }
+    if (!known && !hash_prefix(down.wr_fd, off, down.got_hash))
+        log_info(true, "[ERROR] recv mode 16 error. resume file shrank.\n");
+    fseek(down.wr_fd, off, SEEK_SET);
+    printf("[Download] %s Resume at %llu!\n", down.name, (unsigned long long)off);
+}
+
+/*
+    A download of name makes the resume file of any other version useless.
+*/
+void drop_partial(vector<PARTIAL_FILE>& partials, DOWNLOAD& down) {
+    for (int i = 0; i < partials.size(); i++) {
+        if (partials[i].name != down.name)
+            continue;
+        if (partials[i].path != down.tmp_name)
+            unlink(partials[i].path.c_str());
+        partials.erase(partials.begin() + i);
+        return;
+    }
+}
+
+void mark_dirty(CLIENT& client, const char *name) {
+    struct stat st;
+    if (!local_name(name) || stat(name, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+
+    uint64_t now = now_ms();
+    if (client.dirty.empty())
+        client.dirty_since = now;
+    client.dirty.insert(name);
+    uint64_t at = now + DEBOUNCE_MS;
+    if (at > client.dirty_since + DEBOUNCE_MAX_MS)
+        at = client.dirty_since + DEBOUNCE_MAX_MS;
+    set_timer(client, TIMER_FLUSH, at);
+}
+
+/*
+    The server may not hold what synced says for a name whose upload was
+    aborted, it is tried again once the debounce is over.
+*/
+void retry_put(CLIENT& client, const char *name) {
+    client.synced.erase(name);
+    mark_dirty(client, name);
+}
+
+/*
+    Handles one frame from the server, a reply to one of the running
+    uploads or part of a download, client.seg is set when a raw segment
+    body follows.
+*/
+void handle_frame(CLIENT& client, PACKAGE& pkg) {
+    map<int, DOWNLOAD *>::iterator it = client.downloads.find(pkg.stream);
+    DOWNLOAD *down = it == client.downloads.end() ? NULL : it->second;
+    UPLOAD *up = find_upload(client.uploads, pkg.stream);
+
+    if ((pkg.mode == 3 && pkg.len > 8) || (pkg.mode == 11 && pkg.len > 16) || (pkg.mode == 16 && pkg.len > 24)) {
+        int head = pkg.mode == 3 ? 8 : pkg.mode == 11 ? 16 : 24;
+        if (down != NULL || pkg.len - head >= 30)
+            log_info(true, "[ERROR] recv download begin error. bad stream or name.\n");
+        down = new DOWNLOAD();
+        down->id = pkg.stream;
+        down->got_hash = HASH_INIT;
+        if (pkg.mode == 16) {
+            down->size = get_u64(pkg.buf);
+            down->hash = get_u64(pkg.buf + 8);
+            strcpy(down->name, pkg.buf + 24);
+            open_resumable(*down, get_u64(pkg.buf + 16), client.partials);
+        } else if (pkg.mode == 3) {
+            down->size = get_u64(pkg.buf);
+            strcpy(down->name, pkg.buf + 8);
+            sprintf(down->tmp_name, ".%s.%d.part", down->name, down->id);
+            down->wr_fd = fopen(down->tmp_name, "wb");
+        } else {
+            down->size = get_u64(pkg.buf);
+            down->hash = get_u64(pkg.buf + 8);
+            down->delta = true;
+            strcpy(down->name, pkg.buf + 16);
+            sprintf(down->tmp_name, ".%s.%d.part", down->name, down->id);
+            down->base_fd = open(down->name, O_RDONLY);
+            down->wr_fd = fopen(down->tmp_name, "wb");
+            if (down->base_fd == -1)
+                log_info(true, "[ERROR] recv mode 11 error. cannot open base file.\n");
+        }
+        if (down->wr_fd == NULL)
+            log_info(true, "[ERROR] recv download begin error. cannot open file.\n");
+        client.downloads[down->id] = down;
+        drop_partial(client.partials, *down);
+
+        printf("[Download] %s Start!\n", down->name);
+        printf("Progress : [######################]\n");
+    } else if (pkg.mode == 13 && down != NULL && !down->delta) {
+        client.seg = down;
+        client.seg_left = pkg.len;
+    } else if (pkg.mode == 12 && pkg.len == 12 && down != NULL && down->delta) {
+        char chunk[CHUNK_MAX];
+        uint32_t net_len;
+        memcpy(&net_len, pkg.buf + 8, 4);
+        uint32_t len = ntohl(net_len);
+        if (len > CHUNK_MAX || pread(down->base_fd, chunk, len, get_u64(pkg.buf)) != len)
+            log_info(true, "[ERROR] recv mode 12 error. base file changed.\n");
+        fwrite(chunk, 1, len, down->wr_fd);
+        down->got_hash = hash_update(down->got_hash, chunk, len);
+    } else if (pkg.mode == 2 && down != NULL) {
+        if (pkg.len == 0) {
+            finish_download(client, *down);
+            client.downloads.erase(it);
+            delete down;
+        } else if (down->delta || client.deflate) {
+            fwrite(pkg.buf, 1, pkg.len, down->wr_fd);
+            down->got_hash = hash_update(down->got_hash, pkg.buf, pkg.len);
+        } else
+            log_info(true, "[ERROR] recv mode 2 error. unexpected data.\n");
+    } else if (pkg.mode == 19 && down != NULL && !down->delta && client.deflate) {
+        char block[PACK_BLOCK];
+        uLongf len = sizeof(block);
+        if (uncompress((Bytef *)block, &len, (Bytef *)pkg.buf, pkg.len) != Z_OK)
+            log_info(true, "[ERROR] recv mode 19 error. bad deflated block.\n");
+        fwrite(block, 1, len, down->wr_fd);
+        down->got_hash = hash_update(down->got_hash, block, len);
+    } else if (pkg.mode == 14 && down != NULL) {
+        printf("[Download] %s Superseded!\n", down->name);
+        drop_download(*down);
+        client.downloads.erase(it);
+        delete down;
+    } else if (pkg.mode == 9 && up != NULL && up->state == 2 && pkg.len % 4 == 0) {
+        for (int i = 0; i < pkg.len; i += 4) {
+            uint32_t net_idx;
+            memcpy(&net_idx, pkg.buf + i, 4);
+            uint32_t idx = ntohl(net_idx);
+            if (idx >= up->chunks.size())
+                log_info(true, "[ERROR] recv mode 9 error. bad chunk index.\n");
+            up->need.push_back(idx);
+        }
+    } else if (pkg.mode == 10 && up != NULL && up->state == 2)
+        up->state = 3;
+    else if (pkg.mode == 15 && (pkg.len == 4 || pkg.len == 8)) {
+        client.peer_frame = limit_get(pkg);
+        client.peer_deflate = limit_flags(pkg) & FEATURE_DEFLATE;
+    } else if (pkg.mode == 20 && pkg.len > 0 && pkg.len < 30 && pkg.stream % 2 == 1) {
+        printf("[Upload] %s Rejected!\n", pkg.buf);
+        if (up != NULL)
+            up->state = 4;
+        else
+            retry_put(client, pkg.buf);
+    }
+    else
+        log_info(true, "[ERROR] recv() unknown mode.\n");
+}
+
+/*
+    Gives every running upload one turn at out, starting after the one that
+    went first last time. The frame size is picked once per round from the
+    connection's current congestion window.
+*/
+void fill_uploads(CLIENT& client) {
+    vector<UPLOAD *>& uploads = client.uploads;
+    uint32_t frame = uploads.empty() ? BUF_SIZE : frame_target(client.fd, client.peer_frame);
+    for (size_t cnt = uploads.size(); cnt > 0 && !uploads.empty(); cnt--) {
+        client.rr = (client.rr + 1) % uploads.size();
+        UPLOAD *up = uploads[client.rr];
+        if (up->state == 2 || up->state >= 5 || !fill_upload(*up, client.out, frame, client.deflate && client.peer_deflate))
+            continue;
+
+        if (up->state == 4)
+            retry_put(client, up->name);
+        else
+            printf("[Upload] %s Finish!\n", up->name);
+        uploads.erase(uploads.begin() + client.rr);
+        delete up;
+    }
+}
+
+/*
+    Resumable downloads keep what they got for the next session.
+*/
+void close_transfers(CLIENT& client) {
+    for (int i = 0; i < client.uploads.size(); i++) {
+        close(client.uploads[i]->fd);
+        delete client.uploads[i];
+    }
+    client.uploads.clear();
+
+    map<int, DOWNLOAD *>::iterator it = client.downloads.begin();
+    for (; it != client.downloads.end(); it++) {
+        if (it->second->resumable)
+            fclose(it->second->wr_fd);
+        else
+            drop_download(*it->second);
+        delete it->second;
+    }
+    client.downloads.clear();
+}
+
 void set_no_blocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1)
@@ -47,16 +883,247 @@ void set_no_blocking(int fd) {
         log_info(true, "[ERROR] failed to set fd flags.\n");
 }
 
+/*
+    Queues the manifest, the partial copies and the manifest end, as much
+    as fits in out.
+*/
+void send_manifest(CLIENT& client) {
+    while (!client.manifest_done && client.manifest_sent < client.manifest.size()) {
+        LOCAL_FILE& file = client.manifest[client.manifest_sent];
+        if (!manifest_push(client.out, file.name.c_str(), file.size, file.hash))
+            return;
+        client.manifest_sent++;
+    }
+    while (!client.manifest_done && client.partial_sent < client.partials.size()) {
+        PARTIAL_FILE& file = client.partials[client.partial_sent];
+        if (!partial_push(client.out, file.name.c_str(), file.size, file.hash, file.off))
+            return;
+        client.partial_sent++;
+    }
+    if (!client.manifest_done && frame_push(client.out, 5, 0, "", 0)) {
+        client.manifest_done = true;
+        client.manifest.clear();
+    }
+}
+
+/*
+    Asks the server again for the files whose download was dropped.
+*/
+void send_refetch(CLIENT& client) {
+    while (client.manifest_done && !client.refetch.empty()) {
+        const string& name = client.refetch.front();
+        if (!frame_push(client.out, 21, 0, name.c_str(), name.size()))
+            return;
+        client.refetch.pop_front();
+    }
+}
+
+/*
+    Fills out and sends until the socket would block or nothing is left.
+*/
+void pump_output(CLIENT& client) {
+    while (client.can_write) {
+        send_manifest(client);
+        send_refetch(client);
+        start_puts(client);
+        fill_uploads(client);
+        if (buf_size(client.out) == 0)
+            return;
+
+        ssize_t len = buf_send(client.out, client.fd);
+        if (len == -1) {
+            if (errno != EAGAIN)
+                log_info(true, "[ERROR] send() error.\n");
+            log_info(false, "[INFO] send() not finished.\n");
+            client.can_write = false;
+        }
+    }
+}
+
+/*
+    Reads until EAGAIN, segment bodies go straight from the ring to their
+    file. Returns false once the server closed the connection.
+*/
+bool recv_server(CLIENT& client) {
+    while (true) {
+        bool full = buf_space(client.in) == 0;
+        ssize_t len = buf_recv(client.in, client.fd);
+        if (len == -1 && errno != EAGAIN)
+            log_info(true, "[ERROR] recv() error.\n");
+
+        int frame = 1;
+        while (frame == 1) {
+            if (client.seg_left > 0) {
+                iovec iov[2];
+                if (buf_size(client.in) == 0)
+                    break;
+                buf_data_iov(client.in, iov);
+                uint32_t piece = iov[0].iov_len < client.seg_left ? iov[0].iov_len : client.seg_left;
+                DOWNLOAD *seg = client.seg;
+                fwrite(iov[0].iov_base, 1, piece, seg->wr_fd);
+                seg->got_hash = hash_update(seg->got_hash, (char *)iov[0].iov_base, piece);
+                client.in.head += piece;
+                client.seg_left -= piece;
+                continue;
+            }
+
+            frame = frame_pop(client.in, client.pkg);
+            if (frame == 1)
+                handle_frame(client, client.pkg);
+        }
+        if (frame == -1)
+            log_info(true, "[ERROR] recv() bad frame.\n");
+        if (len == 0)
+            return false;
+        if (len == -1 && !full) {
+            log_info(false, "[INFO] recv() not finished.\n");
+            return true;
+        }
+    }
+}
+
+/*
+    Moves the changed names to the put queue, they are only sent if their
+    content differs from what the server holds.
+*/
+void flush_dirty(CLIENT& client) {
+    set<string>::iterator it = client.dirty.begin();
+    for (; it != client.dirty.end(); it++)
+        queue_put(client, *it, false);
+    client.dirty.clear();
+    client.dirty_since = 0;
+    set_timer(client, TIMER_FLUSH, 0);
+}
+
+/*
+    Files closed after writing or moved into the directory are marked
+    dirty. Events lost to a queue overflow are made up for by marking every
+    file, the content check keeps that from sending unchanged ones. Only
+    the names are listed here, scan_uploads reads the files.
+*/
+void read_watch(CLIENT& client) {
+    char events[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    while (true) {
+        ssize_t len = read(client.watch_fd, events, sizeof(events));
+        if (len <= 0)
+            return;
+        for (char *p = events; p < events + len;) {
+            inotify_event *ev = (inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                vector<string> names;
+                list_local(names);
+                for (int i = 0; i < names.size(); i++)
+                    mark_dirty(client, names[i].c_str());
+            } else if (ev->len > 0)
+                mark_dirty(client, ev->name);
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+}
+
+void read_stdin(CLIENT& client) {
+    char buf[BUF_SIZE];
+    while (client.stdin_open) {
+        ssize_t len = read(0, buf, sizeof(buf));
+        if (len == -1 && errno == EAGAIN)
+            break;
+        if (len <= 0) {
+            client.stdin_open = false;
+            break;
+        }
+        client.line.append(buf, len);
+    }
+
+    /* the last word may still be cut short unless stdin ended */
+    size_t start = 0, end;
+    while ((start = client.line.find_first_not_of(" \t\r\n", start)) != string::npos) {
+        end = client.line.find_first_of(" \t\r\n", start);
+        if (end == string::npos && client.stdin_open)
+            break;
+        client.words.push_back(client.line.substr(start, end == string::npos ? string::npos : end - start));
+        start = end;
+    }
+    client.line.erase(0, start == string::npos ? client.line.size() : start);
+}
+
+/*
+    Runs the complete commands at the front of words. A /sleep stops them
+    until its countdown on TIMER_SLEEP is over, the transfers keep going.
+*/
+void run_commands(CLIENT& client) {
+    while (client.sleep_total == 0 && !client.exiting && !client.words.empty()) {
+        string cmd = client.words.front();
+        if ((cmd == "/put" || cmd == "/sleep") && client.words.size() < 2)
+            return;
+        client.words.pop_front();
+
+        if (cmd == "/exit") {
+            client.exiting = true;
+            flush_dirty(client);
+        } else if (cmd == "/sleep") {
+            int second = atoi(client.words.front().c_str());
+            client.words.pop_front();
+            printf("The client starts to sleep.\n");
+            if (second <= 0)
+                printf("Client wakes up.\n");
+            else {
+                client.sleep_total = second;
+                client.sleep_done = 0;
+                set_timer(client, TIMER_SLEEP, now_ms() + 1000);
+            }
+        } else if (cmd == "/put") {
+            string name = client.words.front();
+            client.words.pop_front();
+            if (access(name.c_str(), F_OK) == -1 || name.size() >= 30)
+                log_info(false, "[INFO] file didn't exist.\n");
+            else
+                queue_put(client, name, true);
+        }
+    }
+}
+
+void run_timers(CLIENT& client) {
+    uint64_t expirations, now = now_ms();
+    read(client.timer_fd, &expirations, sizeof(expirations));
+
+    if (client.deadline[TIMER_SLEEP] != 0 && client.deadline[TIMER_SLEEP] <= now) {
+        printf("Sleep %d.\n", ++client.sleep_done);
+        client.deadline[TIMER_SLEEP] += 1000;
+        if (client.sleep_done == client.sleep_total) {
+            printf("Client wakes up.\n");
+            client.sleep_total = 0;
+            client.deadline[TIMER_SLEEP] = 0;
+        }
+    }
+    if (client.deadline[TIMER_FLUSH] != 0 && client.deadline[TIMER_FLUSH] <= now)
+        flush_dirty(client);
+    arm_timer(client);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4)
-        log_info(true, "[USAGE] <program> <IP> <port> <username>\n");
+    const char *usage = "[USAGE] <program> <IP> <port> <username> [-m] [-r]\n";
+    if (argc < 4)
+        log_info(true, usage);
+
+    CLIENT client;
+    bool watch = true;
+    int opt;
+    optind = 4;
+    while ((opt = getopt(argc, argv, "mr")) != -1) {
+        if (opt == 'm')
+            watch = false;
+        else if (opt == 'r')
+            client.deflate = false;
+        else
+            log_info(true, usage);
+    }
 
     int port;
     if (sscanf(argv[2], "%d", &port) != 1 || port < 0)
         log_info(true, "[ERROR] port must be a positive number.\n");
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1)
+    client.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client.fd == -1)
         log_info(true, "[ERROR] socket() error.\n");
 
     sockaddr_in server_address;
@@ -64,161 +1131,78 @@ int main(int argc, char *argv[]) {
     server_address.sin_port = htons(port);
     inet_aton(argv[1], &server_address.sin_addr);
 
-    if (connect(server_fd, (sockaddr *)&server_address, sizeof(server_address)) == -1)
+    if (connect(client.fd, (sockaddr *)&server_address, sizeof(server_address)) == -1)
         log_info(true, "[ERROR] connect() error.\n");
+    int flag = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    set_no_blocking(client.fd);
 
-    int max_fd = server_fd;
-    fd_set rd, rd_backup, wr, wr_backup;
-    FD_ZERO(&rd_backup);
-    FD_ZERO(&wr_backup);
-    FD_SET(0, &rd_backup);
-    FD_SET(server_fd, &rd_backup);
-    FD_SET(server_fd, &wr_backup);
-
-    PACKAGE up_package, down_package;
-    up_package.mode = 0;
-    up_package.len = -1;
-    strcpy(up_package.buf, argv[3]);
-    send(server_fd, &up_package, sizeof(up_package), 0);
-
-    FILE *wr_fd = NULL;
-    FILE *rd_fd = NULL;
+    if (strlen(argv[3]) >= 30)
+        log_info(true, "[ERROR] username too long.\n");
+    frame_push(client.out, 0, 0, argv[3], strlen(argv[3]));
+    limit_push(client.out, FEATURE_RESUME | (client.deflate ? FEATURE_DEFLATE : 0));
 
-    bool put_suc = true;
+    /* watch before listing so nothing changed in between is missed */
+    if (watch) {
+        client.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (client.watch_fd == -1 || inotify_add_watch(client.watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+            log_info(true, "[ERROR] inotify() error.\n");
+    }
+    build_manifest(client.manifest);
+    find_partials(client.partials);
+    for (int i = 0; i < client.manifest.size(); i++)
+        client.synced[client.manifest[i].name] = client.manifest[i];
 
-    char buf[BUF_SIZE];
-    int second;
-    char up_name[BUF_SIZE], down_name[BUF_SIZE];
-    buf[0] = '\0';
+    client.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (client.timer_fd == -1 || loop_init(client.loop, LOOP_EPOLL) == -1)
+        log_info(true, "[ERROR] timerfd_create() or epoll_create1() error.\n");
+    if (loop_add(client.loop, client.fd, EV_READ | EV_WRITE) == -1 || loop_add(client.loop, client.timer_fd, EV_READ) == -1 ||
+        (watch && loop_add(client.loop, client.watch_fd, EV_READ) == -1))
+        log_info(true, "[ERROR] loop_add() error.\n");
 
-    set_no_blocking(server_fd);
+    /* a regular file on stdin cannot be polled, it never blocks either */
+    int stdin_flags = fcntl(0, F_GETFL, 0);
+    set_no_blocking(0);
+    bool stdin_polled = loop_add(client.loop, 0, EV_READ) == 0;
+    read_stdin(client);
 
+    vector<EVENT> ready;
     while (true) {
-        rd = rd_backup;
-        wr = wr_backup;
-
-        int status = select(max_fd + 1, &rd, &wr, NULL, NULL);
-        if (status < 0)
-            log_info(true, "[ERROR] select() error.\n");
-        else if (status > 0) {
-            if (strlen(buf) == 0 && FD_ISSET(0, &rd)) {
-                scanf("%s", buf);
-                if (!strcmp(buf, "/sleep"))
-                    scanf("%d", &second);
-                else if (!strcmp(buf, "/put"))
-                    scanf("%s", up_name);
-            }
+        run_commands(client);
+        scan_uploads(client);
+        pump_output(client);
+        if (client.exiting && client.uploads.empty() && client.puts.empty() && client.dirty.empty() && buf_size(client.out) == 0)
+            break;
 
-            if (strlen(buf) != 0) {
-                if (!strcmp(buf, "/exit")) {
-                    if (wr_fd != NULL)
-                        fclose(wr_fd);
-                    if (rd_fd != NULL)
-                        fclose(rd_fd);
-                    close(server_fd);
-
-                    break;
-                } else if (!strcmp(buf, "/sleep")) {
-                    printf("The client starts to sleep.\n");
-                    for (int i = 0; i < second; i++) {
-                        sleep(1);
-                        printf("Sleep %d.\n", i + 1);
-                    }
-                    printf("Client wakes up.\n");
-
-                    buf[0] = '\0';
-                } else if(!strcmp(buf, "/put")) {
-                    if (FD_ISSET(server_fd, &wr)) {
-                        if (rd_fd == NULL) {
-                            if (access(up_name, F_OK) == -1) {
-                                log_info(false, "[INFO] file didn't exist.\n");
-                                buf[0] = '\0';
-                            } else {
-                                up_package.mode = 1;
-                                up_package.len = -1;
-                                strcpy(up_package.buf, up_name);
-
-                                int len = send(server_fd, &up_package, sizeof(up_package), 0);
-                                if (len == -1) {
-                                    if (errno == EAGAIN)
-                                        log_info(false, "[INFO] send() not finished.\n");
-                                    else
-                                        log_info(true, "[ERROR] send() error.\n");
-                                } else {
-                                    rd_fd = fopen(up_package.buf, "rb");
-
-                                    printf("[Upload] %s Start!\n", up_name);
-                                    printf("Progress : [######################]\n");
-                                }
-                            }
-                        } else {
-                            if (put_suc) {
-                                up_package.mode = 2;
-                                up_package.len = fread(up_package.buf, 1, BUF_SIZE, rd_fd);
-                            }
-
-                            int len = send(server_fd, &up_package, sizeof(up_package), 0);
-                            if (len == -1) {
-                                put_suc = false;
-                                if (errno == EAGAIN)
-                                    log_info(false, "[INFO] send() not finished.\n");
-                                else
-                                    log_info(true, "[ERROR] send() error.\n");
-                            } else {
-                                put_suc = true;
-                                if (up_package.len == 0) {
-                                    fclose(rd_fd);
-                                    rd_fd = NULL;
-                                    buf[0] = '\0';
-
-                                    printf("[Upload] %s Finish!\n", up_name);
-                                }
-                            }
-                        }
-                    }
-                } else 
-                    buf[0] = '\0';
-            }
-
-            if (FD_ISSET(server_fd, &rd)) {
-                int len = recv(server_fd, &down_package, sizeof(down_package), 0);
-                if (len == -1) {
-                    if (errno == EAGAIN)
-                        log_info(false, "[INFO] recv() not finished.\n");
-                    else
-                        log_info(true, "[ERROR] recv() error.\n");
-                } else if (len == 0) {
-                    if (wr_fd != NULL)
-                        fclose(wr_fd);
-                    if (rd_fd != NULL)
-                        fclose(rd_fd);
-                    close(server_fd);
-
-                    break;
-                } else {
-                    if (down_package.mode == 1) {
-                        wr_fd = fopen(down_package.buf, "wb");
-                        strcpy(down_name, down_package.buf);
-
-                        printf("[Download] %s Start!\n", down_name);
-                        printf("Progress : [######################]\n");
-                    }
-                    else if (down_package.mode == 2) {
-                        if (wr_fd == NULL)
-                            log_info(true, "[ERROR] recv mode 2 error. no wr_fd.\n");
-                        if (down_package.len == 0) {
-                            fclose(wr_fd);
-                            wr_fd = NULL;
-                            
-                            printf("[Download] %s Finish!\n", down_name);
-                        }
-                        else
-                            fwrite(down_package.buf, 1, down_package.len, wr_fd);
-                    }
-                }
+        /* an upload still reading its file only looks for events */
+        if (loop_wait(client.loop, ready, scanning(client) ? 0 : -1) == -1 && errno != EINTR)
+            log_info(true, "[ERROR] epoll_wait() error.\n");
+        bool closed = false;
+        for (int i = 0; i < ready.size(); i++) {
+            int fd = ready[i].fd;
+            if (fd == client.fd) {
+                if (ready[i].events & EV_WRITE)
+                    client.can_write = true;
+                if ((ready[i].events & EV_READ) && !recv_server(client))
+                    closed = true;
+            } else if (fd == client.timer_fd)
+                run_timers(client);
+            else if (fd == client.watch_fd)
+                read_watch(client);
+            else if (fd == 0) {
+                read_stdin(client);
+                if (!client.stdin_open)
+                    loop_del(client.loop, 0);
             }
         }
+        if (!stdin_polled)
+            read_stdin(client);
+        if (closed)
+            break;
     }
 
+    close_transfers(client);
+    close(client.fd);
+    fcntl(0, F_SETFL, stdin_flags);
     return 0;
 }
@@ -0,0 +1,60 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+
+/*
+    CRC32C (Castagnoli), the checksum of each chunk. On x86 with SSE4.2 the
+    crc32 instruction does 8 bytes per step, elsewhere a byte table is
+    used, both give the same value. crc32c_update(0, data, len) is the crc
+    of data, passing the previous result continues it.
+*/
+struct CRC32C_TABLE {
+    uint32_t value[256];
+
+    CRC32C_TABLE() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++)
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            this->value[i] = crc;
+        }
+    }
+};
+
+static inline uint32_t crc32c_soft(uint32_t crc, const char *data, size_t len) {
+    static CRC32C_TABLE table;
+    for (size_t i = 0; i < len; i++)
+        crc = table.value[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hard(uint32_t crc, const char *data, size_t len) {
+    uint64_t val = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        val = __builtin_ia32_crc32di(val, word);
+    }
+    uint32_t part = val;
+    for (; len > 0; data++, len--)
+        part = __builtin_ia32_crc32qi(part, *data);
+    return part;
+}
+#endif
+
+static inline uint32_t crc32c_update(uint32_t crc, const char *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static bool hard = __builtin_cpu_supports("sse4.2");
+    if (hard)
+        return ~crc32c_hard(crc, data, len);
+#endif
+    return ~crc32c_soft(crc, data, len);
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef DISK_POOL_H
+#define DISK_POOL_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    Worker threads for file operations that may block. A job is queued on
+    the worker picked by its key, so all jobs with the same key run one
+    after another in submit order. When run() returns the job is pushed on
+    its done list and wake_fd (an eventfd) is written, the reactor that
+    owns the list pops the finished jobs with disk_drain().
+*/
+struct DISK_JOB {
+    void (*run)(DISK_JOB&);
+    void *ctx;
+    std::atomic<DISK_JOB *> *done;
+    int wake_fd;
+    DISK_JOB *next;
+};
+
+struct DISK_WORKER {
+    std::mutex lock;
+    std::condition_variable ready;
+    DISK_JOB *head, *tail;
+
+    DISK_WORKER() {
+        this->head = NULL;
+        this->tail = NULL;
+    }
+};
+
+struct DISK_POOL {
+    std::vector<DISK_WORKER *> workers;
+};
+
+static inline void disk_work(DISK_WORKER *worker) {
+    while (true) {
+        DISK_JOB *job;
+        {
+            std::unique_lock<std::mutex> guard(worker->lock);
+            while (worker->head == NULL)
+                worker->ready.wait(guard);
+            job = worker->head;
+            worker->head = job->next;
+            if (worker->head == NULL)
+                worker->tail = NULL;
+        }
+
+        job->run(*job);
+
+        DISK_JOB *top = job->done->load(std::memory_order_relaxed);
+        do {
+            job->next = top;
+        } while (!job->done->compare_exchange_weak(top, job, std::memory_order_release, std::memory_order_relaxed));
+
+        uint64_t one = 1;
+        while (write(job->wake_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+    }
+}
+
+static inline void disk_init(DISK_POOL& pool, int cnt) {
+    for (int i = 0; i < cnt; i++) {
+        DISK_WORKER *worker = new DISK_WORKER();
+        pool.workers.push_back(worker);
+        std::thread(disk_work, worker).detach();
+    }
+}
+
+static inline void disk_submit(DISK_POOL& pool, uint32_t key, DISK_JOB *job) {
+    DISK_WORKER *worker = pool.workers[key % pool.workers.size()];
+    job->next = NULL;
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if (worker->tail == NULL)
+        worker->head = job;
+    else
+        worker->tail->next = job;
+    worker->tail = job;
+    worker->ready.notify_one();
+}
+
+/*
+    Takes every finished job off the list, oldest first.
+*/
+static inline DISK_JOB *disk_drain(std::atomic<DISK_JOB *>& done) {
+    DISK_JOB *list = done.exchange(NULL, std::memory_order_acquire), *fifo = NULL;
+    while (list != NULL) {
+        DISK_JOB *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    return fifo;
+}
+
+#endif
@@ -0,0 +1,462 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <vector>
+
+#define EV_READ 1
+#define EV_WRITE 2
+#define EV_RECV 4
+#define EV_SEND 8
+
+#define LOOP_SELECT 0
+#define LOOP_EPOLL 1
+#define LOOP_URING 2
+
+#define MAX_EVENTS 256
+#define URING_ENTRIES 4096
+
+/*
+    EV_RECV and EV_SEND only come from the io_uring backend and report a
+    finished loop_recv()/loop_send(), res is its return value or -errno.
+*/
+struct EVENT {
+    int fd, events, res;
+};
+
+/*
+    user_data of a submission, the fd in the high bits and what it was
+    for in the low byte
+*/
+#define URING_POLL 1
+#define URING_POLL_OUT 2
+#define URING_RECV 3
+#define URING_SEND 4
+#define URING_CANCEL 5
+
+struct URING {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned pending;
+};
+
+struct EVENT_LOOP {
+    /*
+        backend
+        0: select, level-triggered, fd < FD_SETSIZE
+        1: epoll, edge-triggered
+        2: io_uring, multishot polls for loop_add() fds and completions of
+           the socket I/O queued with loop_recv()/loop_send()
+    */
+    int backend;
+    int epoll_fd, max_fd;
+    fd_set rd_backup, wr_backup;
+    std::vector<int> interest;
+    epoll_event ep_events[MAX_EVENTS];
+    URING ring;
+
+    EVENT_LOOP() {
+        this->backend = LOOP_SELECT;
+        this->epoll_fd = -1;
+        this->max_fd = -1;
+        this->ring.fd = -1;
+        FD_ZERO(&this->rd_backup);
+        FD_ZERO(&this->wr_backup);
+    }
+};
+
+static inline int uring_enter(URING& ring, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t arg_len) {
+    return syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags, arg, arg_len);
+}
+
+static inline int uring_init(URING& ring, unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd == -1)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring.fd);
+        ring.fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (ring.cq_len > ring.sq_len)
+        ring.sq_len = ring.cq_len;
+    ring.sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes = (io_uring_sqe *)mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                                     IORING_OFF_SQES);
+    if (ring.sq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+    ring.cq_ptr = ring.sq_ptr;
+
+    char *sq = (char *)ring.sq_ptr, *cq = (char *)ring.cq_ptr;
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.pending = 0;
+    return 0;
+}
+
+/*
+    Returns a zeroed submission slot, submitting what is queued first if the
+    ring is full.
+*/
+static inline io_uring_sqe *uring_sqe(URING& ring, int fd, int kind) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > *ring.sq_mask) {
+        if (uring_enter(ring, ring.pending, 0, 0, NULL, 0) == -1)
+            return NULL;
+        ring.pending = 0;
+    }
+
+    unsigned idx = tail & *ring.sq_mask;
+    io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)fd << 8 | kind;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    return sqe;
+}
+
+/*
+    Registers buf as fixed buffer 0, READ_FIXED and WRITE_FIXED submissions
+    into it then skip pinning its pages on every call.
+*/
+static inline int uring_register_buffer(URING& ring, void *buf, size_t len) {
+    iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+/*
+    Submits what is queued and waits until cnt submissions are complete,
+    res[i] gets the result of the one whose user_data is i. Only for a ring
+    nothing else submits to, with cnt at most its size.
+*/
+static inline int uring_run(URING& ring, unsigned cnt, int *res) {
+    unsigned done = 0;
+    while (done < cnt) {
+        unsigned queued = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (uring_enter(ring, queued, cnt - done, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+            return -1;
+        ring.pending = 0;
+
+        unsigned head = *ring.cq_head, tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, done++) {
+            io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static inline int uring_poll(URING& ring, int fd, int events, int kind) {
+    io_uring_sqe *sqe = uring_sqe(ring, fd, kind);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = 0;
+    if (events & EV_READ)
+        sqe->poll32_events |= POLLIN | POLLRDHUP;
+    if (events & EV_WRITE)
+        sqe->poll32_events |= POLLOUT;
+    if (kind == URING_POLL)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    return 0;
+}
+
+/*
+    Every function returns -1 on failure and leaves errno set, the caller
+    decides whether that is fatal. With the epoll backend a ready event is only
+    reported once per edge, so the caller must keep a connection busy until
+    recv()/send() hit EAGAIN.
+*/
+static inline int loop_init(EVENT_LOOP& loop, int backend) {
+    loop.backend = backend;
+    if (backend == LOOP_EPOLL) {
+        loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop.epoll_fd == -1)
+            return -1;
+    } else if (backend == LOOP_URING)
+        return uring_init(loop.ring, URING_ENTRIES);
+    return 0;
+}
+
+static inline void loop_close(EVENT_LOOP& loop) {
+    if (loop.epoll_fd != -1) {
+        close(loop.epoll_fd);
+        loop.epoll_fd = -1;
+    }
+    if (loop.ring.fd != -1) {
+        munmap(loop.ring.sqes, loop.ring.sqes_len);
+        munmap(loop.ring.sq_ptr, loop.ring.sq_len);
+        close(loop.ring.fd);
+        loop.ring.fd = -1;
+    }
+}
+
+static inline unsigned loop_to_epoll(int events) {
+    unsigned ep = EPOLLET | EPOLLRDHUP;
+    if (events & EV_READ)
+        ep |= EPOLLIN;
+    if (events & EV_WRITE)
+        ep |= EPOLLOUT;
+    return ep;
+}
+
+static inline int loop_ctl(EVENT_LOOP& loop, int op, int fd, int events) {
+    if (loop.backend == LOOP_EPOLL) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = loop_to_epoll(events);
+        ev.data.fd = fd;
+        return epoll_ctl(loop.epoll_fd, op, fd, &ev);
+    }
+
+    /*
+        A changed or removed poll is cancelled, loop_wait() arms it again
+        with the new interest once the cancellation completes.
+    */
+    if (loop.backend == LOOP_URING) {
+        if ((int)loop.interest.size() <= fd)
+            loop.interest.resize(fd + 1, 0);
+        loop.interest[fd] = op == EPOLL_CTL_DEL ? 0 : events;
+        if (op == EPOLL_CTL_ADD)
+            return uring_poll(loop.ring, fd, events, URING_POLL);
+
+        io_uring_sqe *sqe = uring_sqe(loop.ring, fd, URING_CANCEL);
+        if (sqe == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)fd << 8 | URING_POLL;
+        return 0;
+    }
+
+    if (fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    if ((int)loop.interest.size() <= fd)
+        loop.interest.resize(fd + 1, 0);
+    loop.interest[fd] = op == EPOLL_CTL_DEL ? 0 : events;
+
+    FD_CLR(fd, &loop.rd_backup);
+    FD_CLR(fd, &loop.wr_backup);
+    if (loop.interest[fd] & EV_READ)
+        FD_SET(fd, &loop.rd_backup);
+    if (loop.interest[fd] & EV_WRITE)
+        FD_SET(fd, &loop.wr_backup);
+
+    if (op == EPOLL_CTL_DEL) {
+        while (loop.max_fd >= 0 && loop.interest[loop.max_fd] == 0)
+            loop.max_fd--;
+    } else if (fd > loop.max_fd)
+        loop.max_fd = fd;
+    return 0;
+}
+
+static inline int loop_add(EVENT_LOOP& loop, int fd, int events) {
+    return loop_ctl(loop, EPOLL_CTL_ADD, fd, events);
+}
+
+static inline int loop_mod(EVENT_LOOP& loop, int fd, int events) {
+    return loop_ctl(loop, EPOLL_CTL_MOD, fd, events);
+}
+
+static inline int loop_del(EVENT_LOOP& loop, int fd) {
+    return loop_ctl(loop, EPOLL_CTL_DEL, fd, 0);
+}
+
+/*
+    Queue a readv()/sendmsg() on a socket, only with the io_uring backend.
+    iov and msg must stay valid until the EV_RECV/EV_SEND event for fd.
+    loop_poll_out() asks for one EV_WRITE once fd is writable.
+*/
+static inline int loop_recv(EVENT_LOOP& loop, int fd, iovec *iov, int cnt) {
+    if (loop.backend != LOOP_URING) {
+        errno = ENOSYS;
+        return -1;
+    }
+    io_uring_sqe *sqe = uring_sqe(loop.ring, fd, URING_RECV);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READV;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = cnt;
+    return 0;
+}
+
+static inline int loop_send(EVENT_LOOP& loop, int fd, msghdr *msg) {
+    if (loop.backend != LOOP_URING) {
+        errno = ENOSYS;
+        return -1;
+    }
+    io_uring_sqe *sqe = uring_sqe(loop.ring, fd, URING_SEND);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+static inline int loop_poll_out(EVENT_LOOP& loop, int fd) {
+    if (loop.backend != LOOP_URING) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return uring_poll(loop.ring, fd, EV_WRITE, URING_POLL_OUT);
+}
+
+/*
+    Submits everything queued since the last call and waits in the same
+    io_uring_enter(), then turns the completions into events.
+*/
+static inline int uring_wait(EVENT_LOOP& loop, std::vector<EVENT>& ready, int timeout) {
+    URING& ring = loop.ring;
+    unsigned flags = timeout != 0 ? IORING_ENTER_GETEVENTS : 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    void *argp = NULL;
+    size_t arg_len = 0;
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000ll;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)&ts;
+        argp = &arg;
+        arg_len = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) || ring.pending > 0) {
+        unsigned wait = head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) && timeout != 0 ? 1 : 0;
+        if (uring_enter(ring, ring.pending, wait, wait ? flags : 0, wait ? argp : NULL, wait ? arg_len : 0) == -1 &&
+            errno != EINTR && errno != ETIME && errno != EBUSY)
+            return -1;
+        ring.pending = 0;
+    }
+
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        int kind = cqe->user_data & 0xff, res = cqe->res;
+        EVENT ev;
+        ev.fd = cqe->user_data >> 8;
+        ev.events = 0;
+        ev.res = res;
+
+        if (kind == URING_POLL) {
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+            if (!more && ev.fd < (int)loop.interest.size() && loop.interest[ev.fd] != 0)
+                uring_poll(ring, ev.fd, loop.interest[ev.fd], URING_POLL);
+            if (res < 0)
+                continue;
+        }
+        if (kind == URING_POLL || kind == URING_POLL_OUT) {
+            if (res < 0 || (res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR)))
+                ev.events |= EV_READ;
+            if (res < 0 || (res & (POLLOUT | POLLHUP | POLLERR)))
+                ev.events |= EV_WRITE;
+        } else if (kind == URING_RECV)
+            ev.events = EV_RECV;
+        else if (kind == URING_SEND)
+            ev.events = EV_SEND;
+        else
+            continue;
+        ready.push_back(ev);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return ready.size();
+}
+
+/*
+    Fills ready with the fds that have events, timeout is in milliseconds and
+    -1 blocks forever. Returns the number of ready fds.
+*/
+static inline int loop_wait(EVENT_LOOP& loop, std::vector<EVENT>& ready, int timeout) {
+    ready.clear();
+    if (loop.backend == LOOP_URING)
+        return uring_wait(loop, ready, timeout);
+
+    if (loop.backend == LOOP_EPOLL) {
+        int n = epoll_wait(loop.epoll_fd, loop.ep_events, MAX_EVENTS, timeout);
+        if (n == -1)
+            return errno == EINTR ? 0 : -1;
+        for (int i = 0; i < n; i++) {
+            EVENT ev;
+            ev.fd = loop.ep_events[i].data.fd;
+            ev.events = 0;
+            ev.res = 0;
+            if (loop.ep_events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                ev.events |= EV_READ;
+            if (loop.ep_events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                ev.events |= EV_WRITE;
+            ready.push_back(ev);
+        }
+        return n;
+    }
+
+    fd_set rd = loop.rd_backup, wr = loop.wr_backup;
+    timeval tv, *tvp = NULL;
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    int status = select(loop.max_fd + 1, &rd, &wr, NULL, tvp);
+    if (status == -1)
+        return errno == EINTR ? 0 : -1;
+    for (int fd = 0; status > 0 && fd <= loop.max_fd; fd++) {
+        EVENT ev;
+        ev.fd = fd;
+        ev.events = 0;
+        ev.res = 0;
+        if (FD_ISSET(fd, &rd))
+            ev.events |= EV_READ;
+        if (FD_ISSET(fd, &wr))
+            ev.events |= EV_WRITE;
+        if (ev.events != 0)
+            ready.push_back(ev);
+    }
+    return ready.size();
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "protocol.h"
+#include "chunker.h"
+
+/*
+    Append-only log of published files, replayed on startup so the server
+    knows the files in the user directories without hashing them again.
+
+    record, integers are big endian
+    +-------+-------------+----------+-----------+---------------+--------+
+    | len 4 | folder name | file name | size 8    | hash 8        | ino 8  |
+    +-------+-------------+----------+-----------+---------------+--------+
+    | mtime 8 | chunk count 4 | chunks, SIG_SIZE each            | sum 8  |
+    +---------+---------------+----------------------------------+--------+
+    names are one length byte followed by the name, len counts everything
+    after itself and sum is hash_update() over the same bytes without sum,
+    so a record torn by a crash ends the replay. ino and mtime tell whether
+    the file on disk is still the one the record describes.
+*/
+#define JOURNAL_RECORD_MAX (64 * 1024 * 1024)
+
+struct JOURNAL_RECORD {
+    std::string folder, name;
+    uint64_t size, hash, ino, mtime;
+    std::vector<CHUNK> chunks;
+};
+
+struct JOURNAL {
+    int fd;
+    std::mutex lock;
+
+    JOURNAL() {
+        this->fd = -1;
+    }
+};
+
+static inline void journal_put_u32(std::string& out, uint32_t val) {
+    uint32_t net = htonl(val);
+    out.append((char *)&net, 4);
+}
+
+static inline void journal_put_u64(std::string& out, uint64_t val) {
+    char buf[8];
+    put_u64(buf, val);
+    out.append(buf, 8);
+}
+
+static inline void journal_encode(std::string& out, JOURNAL_RECORD& rec) {
+    std::string body;
+    body += (char)rec.folder.size();
+    body += rec.folder;
+    body += (char)rec.name.size();
+    body += rec.name;
+    journal_put_u64(body, rec.size);
+    journal_put_u64(body, rec.hash);
+    journal_put_u64(body, rec.ino);
+    journal_put_u64(body, rec.mtime);
+    journal_put_u32(body, rec.chunks.size());
+    for (size_t i = 0; i < rec.chunks.size(); i++) {
+        char sig[SIG_SIZE];
+        sig_put(sig, rec.chunks[i]);
+        body.append(sig, SIG_SIZE);
+    }
+    journal_put_u64(body, hash_update(HASH_INIT, body.data(), body.size()));
+    journal_put_u32(out, body.size());
+    out += body;
+}
+
+/*
+    Decodes the record at data[pos], returns false if it is cut short or
+    its sum does not match.
+*/
+static inline bool journal_decode(const std::string& data, size_t& pos, JOURNAL_RECORD& rec) {
+    uint32_t net;
+    if (data.size() - pos < 4)
+        return false;
+    memcpy(&net, data.data() + pos, 4);
+    uint32_t len = ntohl(net);
+    if (len < 8 || len > JOURNAL_RECORD_MAX || data.size() - pos - 4 < len)
+        return false;
+
+    const char *body = data.data() + pos + 4, *end = body + len - 8;
+    if (hash_update(HASH_INIT, body, len - 8) != get_u64(end))
+        return false;
+
+    const char *p = body;
+    for (int i = 0; i < 2; i++) {
+        if (p >= end || end - p - 1 < (unsigned char)*p)
+            return false;
+        (i == 0 ? rec.folder : rec.name).assign(p + 1, (unsigned char)*p);
+        p += 1 + (unsigned char)*p;
+    }
+    if (end - p < 36)
+        return false;
+    rec.size = get_u64(p);
+    rec.hash = get_u64(p + 8);
+    rec.ino = get_u64(p + 16);
+    rec.mtime = get_u64(p + 24);
+    memcpy(&net, p + 32, 4);
+    uint32_t cnt = ntohl(net);
+    p += 36;
+    if ((uint64_t)(end - p) != (uint64_t)cnt * SIG_SIZE)
+        return false;
+
+    rec.chunks.resize(cnt);
+    uint64_t off = 0;
+    for (uint32_t i = 0; i < cnt; i++, p += SIG_SIZE) {
+        sig_get(p, rec.chunks[i]);
+        rec.chunks[i].off = off;
+        off += rec.chunks[i].len;
+    }
+    pos += 4 + len;
+    return true;
+}
+
+/*
+    Called from the disk workers, the lock keeps records whole. Returns
+    false if the write failed, the record is then recovered by the scan on
+    the next start.
+*/
+static inline bool journal_append(JOURNAL& journal, JOURNAL_RECORD& rec) {
+    std::string out;
+    journal_encode(out, rec);
+    std::lock_guard<std::mutex> guard(journal.lock);
+    if (journal.fd == -1)
+        return false;
+    for (size_t off = 0; off < out.size();) {
+        ssize_t len = write(journal.fd, out.data() + off, out.size() - off);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return false;
+        off += len;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,529 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <cstring>
+#include <vector>
+#include <queue>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include "protocol.h"
+#include "chunker.h"
+#include "event_loop.h"
+using namespace std;
+
+#define DEBUG
+
+#define NAME_SIZE 30
+#define RUN_QUANTUM (256 * 1024)
+
+void log_info(bool error, const char *msg) {
+#ifdef DEBUG
+    if (!error)
+        fprintf(stdout, "%s", msg);
+    else {
+        fprintf(stderr, "%s", msg);
+        exit(1);
+    }
+#endif
+}
+
+double now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+    One file size of the mix. Every upload of that size sends the same
+    random bytes under a fresh name, the server has no old copy to reuse
+    chunks from so all of it goes over the wire.
+*/
+struct SAMPLE {
+    uint64_t size;
+    char *data;
+    vector<CHUNK> chunks;
+};
+
+/*
+    A published file, start is when its upload began and sent when the
+    closing frame left the uploader's buffer.
+*/
+struct TRANSFER {
+    uint64_t size;
+    double start, sent;
+};
+
+struct SESSION {
+    int fd, name_id, uploads_left;
+    bool writer;
+    BUFFER in, out;
+    PACKAGE pkg;
+    uint64_t seg_left;
+    uint32_t peer_frame;
+    unordered_map<int, string> downloads;
+
+    /*
+        state
+        0: no upload running
+        1: sending chunk signatures
+        2: waiting for the chunks the server is missing
+        3: sending the missing chunks
+        4: waiting for the closing frame to leave out
+    */
+    int state, stream;
+    char up_name[NAME_SIZE];
+    SAMPLE *sample;
+    vector<uint32_t> need;
+    size_t sig_sent, need_idx;
+    uint32_t need_off, end_pos;
+
+    SESSION() {
+        this->fd = -1;
+        this->seg_left = 0;
+        this->peer_frame = BUF_SIZE;
+        this->state = 0;
+        this->stream = 1;
+    }
+};
+
+/*
+    Totals of one run, bytes count file content only.
+*/
+struct STATS {
+    uint64_t up_bytes, down_bytes, uploads, downloads, expected;
+    double first_start, last_sent;
+    vector<double> up_ms, fanout_ms;
+    unordered_map<string, TRANSFER> files;
+
+    STATS() {
+        this->up_bytes = 0;
+        this->down_bytes = 0;
+        this->uploads = 0;
+        this->downloads = 0;
+        this->expected = 0;
+        this->first_start = -1;
+        this->last_sent = 0;
+    }
+};
+
+void set_no_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        log_info(true, "[ERROR] failed to get fd flags.\n");
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        log_info(true, "[ERROR] failed to set fd flags.\n");
+}
+
+/*
+    Parses a comma separated list like 4k,64k,1m.
+*/
+bool parse_sizes(const char *arg, vector<uint64_t>& sizes) {
+    while (*arg != '\0') {
+        char *end;
+        uint64_t size = strtoull(arg, &end, 10);
+        if (end == arg)
+            return false;
+        if (*end == 'k' || *end == 'K')
+            size <<= 10, end++;
+        else if (*end == 'm' || *end == 'M')
+            size <<= 20, end++;
+        else if (*end == 'g' || *end == 'G')
+            size <<= 30, end++;
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return false;
+        sizes.push_back(size);
+        arg = end;
+    }
+    return !sizes.empty();
+}
+
+void make_sample(SAMPLE& sample, uint64_t size) {
+    sample.size = size;
+    sample.data = new char[size];
+    uint64_t seed = 0x9e3779b97f4a7c15ull ^ size;
+    for (uint64_t i = 0; i < size; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        sample.data[i] = seed >> 56;
+    }
+
+    CHUNKER chunker;
+    chunker_feed(chunker, sample.data, size, sample.chunks);
+    chunker_finish(chunker, sample.chunks);
+}
+
+/*
+    utime + stime of pid in seconds, -1 if it cannot be read.
+*/
+double cpu_seconds(int pid) {
+    char path[64], line[1024];
+    sprintf(path, "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    size_t len = fread(line, 1, sizeof(line) - 1, fp);
+    fclose(fp);
+    line[len] = '\0';
+
+    /* the command name may contain spaces, fields are counted after it */
+    char *p = strrchr(line, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+bool start_upload(SESSION& s, SAMPLE *sample, STATS& stats) {
+    static int seq = 0;
+    sprintf(s.up_name, "lg%d_%d", (int)(getpid() % 100000), seq);
+    if (!frame_push(s.out, 1, s.stream, s.up_name, strlen(s.up_name)))
+        return false;
+    seq++;
+
+    s.sample = sample;
+    s.need.clear();
+    s.sig_sent = 0;
+    s.need_idx = 0;
+    s.need_off = 0;
+    s.state = 1;
+
+    TRANSFER& file = stats.files[s.up_name];
+    file.size = sample->size;
+    file.start = now_ms();
+    file.sent = -1;
+    if (stats.first_start < 0)
+        stats.first_start = file.start;
+    return true;
+}
+
+/*
+    Same steps as the interactive client's fill_upload(), at most
+    RUN_QUANTUM bytes of chunk data per call.
+*/
+void fill_upload(SESSION& s) {
+    char chunk[BUF_SIZE];
+    uint32_t queued = 0, frame = s.state == 3 ? frame_target(s.fd, s.peer_frame) : BUF_SIZE;
+
+    while (s.state == 1) {
+        if (s.sig_sent == s.sample->chunks.size()) {
+            if (!frame_push(s.out, 8, s.stream, "", 0))
+                return;
+            s.state = 2;
+            return;
+        }
+
+        int cnt = 0;
+        for (; cnt < BUF_SIZE / SIG_SIZE && s.sig_sent + cnt < s.sample->chunks.size(); cnt++) {
+            CHUNK& c = s.sample->chunks[s.sig_sent + cnt];
+            sig_put(chunk + cnt * SIG_SIZE, c);
+        }
+        if (!frame_push(s.out, 7, s.stream, chunk, cnt * SIG_SIZE))
+            return;
+        s.sig_sent += cnt;
+    }
+
+    while (s.state == 3 && queued < RUN_QUANTUM) {
+        if (s.need_idx == s.need.size()) {
+            if (!frame_push(s.out, 2, s.stream, "", 0))
+                return;
+            s.end_pos = s.out.tail;
+            s.state = 4;
+            return;
+        }
+        CHUNK& c = s.sample->chunks[s.need[s.need_idx]];
+        uint32_t len = c.len - s.need_off < frame ? c.len - s.need_off : frame;
+        if (!frame_push(s.out, 2, s.stream, s.sample->data + c.off + s.need_off, len))
+            return;
+        queued += HEADER_SIZE + len;
+        s.need_off += len;
+        if (s.need_off == c.len) {
+            s.need_idx++;
+            s.need_off = 0;
+        }
+    }
+}
+
+void handle_frame(SESSION& s, STATS& stats) {
+    PACKAGE& pkg = s.pkg;
+    if (pkg.mode == 3 && pkg.len > 8)
+        s.downloads[pkg.stream] = pkg.buf + 8;
+    else if (pkg.mode == 11 && pkg.len > 16)
+        s.downloads[pkg.stream] = pkg.buf + 16;
+    else if (pkg.mode == 13)
+        s.seg_left = pkg.len;
+    else if (pkg.mode == 2 && pkg.len == 0 && s.downloads.count(pkg.stream)) {
+        unordered_map<string, TRANSFER>::iterator file = stats.files.find(s.downloads[pkg.stream]);
+        s.downloads.erase(pkg.stream);
+        if (file == stats.files.end())
+            return;
+        stats.downloads++;
+        stats.down_bytes += file->second.size;
+        if (file->second.sent >= 0)
+            stats.fanout_ms.push_back(now_ms() - file->second.sent);
+    } else if (pkg.mode == 14)
+        s.downloads.erase(pkg.stream);
+    else if (pkg.mode == 9 && pkg.stream == s.stream && s.state == 2) {
+        for (int i = 0; i + 4 <= pkg.len; i += 4) {
+            uint32_t net_idx;
+            memcpy(&net_idx, pkg.buf + i, 4);
+            s.need.push_back(ntohl(net_idx));
+        }
+    } else if (pkg.mode == 10 && pkg.stream == s.stream && s.state == 2)
+        s.state = 3;
+    else if (pkg.mode == 15 && (pkg.len == 4 || pkg.len == 8))
+        s.peer_frame = limit_get(pkg);
+}
+
+/*
+    Reads until EAGAIN and throws download bodies away. Returns false if
+    the server closed the connection.
+*/
+bool recv_session(SESSION& s, STATS& stats) {
+    while (true) {
+        ssize_t len = buf_recv(s.in, s.fd);
+        if (len == 0)
+            return false;
+        if (len == -1 && errno != EAGAIN)
+            return false;
+
+        while (true) {
+            if (s.seg_left > 0) {
+                uint32_t skip = buf_size(s.in) < s.seg_left ? buf_size(s.in) : s.seg_left;
+                if (skip == 0)
+                    break;
+                s.in.head += skip;
+                s.seg_left -= skip;
+                continue;
+            }
+            int status = frame_pop(s.in, s.pkg);
+            if (status == -1)
+                return false;
+            if (status == 0)
+                break;
+            handle_frame(s, stats);
+        }
+        if (len == -1)
+            return true;
+    }
+}
+
+/*
+    Fills and sends until the socket is full or there is nothing left,
+    returns false on a send error.
+*/
+bool send_session(SESSION& s, STATS& stats) {
+    while (true) {
+        fill_upload(s);
+        if (buf_size(s.out) == 0)
+            return true;
+        ssize_t len = buf_send(s.out, s.fd);
+        if (len == -1)
+            return errno == EAGAIN;
+
+        if (s.state == 4 && (int32_t)(s.out.head - s.end_pos) >= 0) {
+            TRANSFER& file = stats.files[s.up_name];
+            file.sent = now_ms();
+            stats.up_ms.push_back(file.sent - file.start);
+            stats.up_bytes += file.size;
+            stats.uploads++;
+            stats.last_sent = file.sent;
+            s.state = 0;
+            s.stream += 2;
+            s.uploads_left--;
+            return true;
+        }
+    }
+}
+
+double percentile(vector<double>& v, double p) {
+    if (v.empty())
+        return 0;
+    size_t idx = (size_t)(p * (v.size() - 1) + 0.5);
+    return v[idx];
+}
+
+void report(STATS& stats, double elapsed_ms, double cpu) {
+    sort(stats.up_ms.begin(), stats.up_ms.end());
+    sort(stats.fanout_ms.begin(), stats.fanout_ms.end());
+
+    double up_span = stats.last_sent - stats.first_start;
+    printf("uploads      %llu files, %.1f MB\n", (unsigned long long)stats.uploads, stats.up_bytes / 1048576.0);
+    printf("downloads    %llu of %llu fan-out copies, %.1f MB\n", (unsigned long long)stats.downloads,
+           (unsigned long long)stats.expected, stats.down_bytes / 1048576.0);
+    printf("elapsed      %.1f s\n", elapsed_ms / 1000);
+    if (up_span > 0)
+        printf("upload       %.1f MB/s\n", stats.up_bytes / 1048576.0 / (up_span / 1000));
+    printf("fan-out      %.1f MB/s\n", stats.down_bytes / 1048576.0 / (elapsed_ms / 1000));
+    printf("upload ms    p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", percentile(stats.up_ms, 0.5),
+           percentile(stats.up_ms, 0.9), percentile(stats.up_ms, 0.99), percentile(stats.up_ms, 1));
+    printf("fan-out ms   p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", percentile(stats.fanout_ms, 0.5),
+           percentile(stats.fanout_ms, 0.9), percentile(stats.fanout_ms, 0.99), percentile(stats.fanout_ms, 1));
+    if (cpu >= 0) {
+        double gb = (stats.up_bytes + stats.down_bytes) / 1073741824.0;
+        printf("server cpu   %.2f s, %.2f s/GB\n", cpu, gb > 0 ? cpu / gb : 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *usage = "[USAGE] <program> <IP> <port> [-u sessions] [-n usernames] [-w writers per username] "
+                        "[-f files per writer] [-s sizes] [-i interval ms] [-T timeout s] [-p server pid]\n";
+    if (argc < 3)
+        log_info(true, usage);
+
+    int port;
+    if (sscanf(argv[2], "%d", &port) != 1 || port < 0)
+        log_info(true, "[ERROR] port must be a positive number.\n");
+
+    int session_cnt = 100, name_cnt = 10, writer_cnt = 1, file_cnt = 10, interval = 0, timeout = 60, pid = -1;
+    vector<uint64_t> sizes;
+    int opt;
+    optind = 3;
+    while ((opt = getopt(argc, argv, "u:n:w:f:s:i:T:p:")) != -1) {
+        int *target = NULL;
+        if (opt == 'u')
+            target = &session_cnt;
+        else if (opt == 'n')
+            target = &name_cnt;
+        else if (opt == 'w')
+            target = &writer_cnt;
+        else if (opt == 'f')
+            target = &file_cnt;
+        else if (opt == 'i')
+            target = &interval;
+        else if (opt == 'T')
+            target = &timeout;
+        else if (opt == 'p')
+            target = &pid;
+        else if (opt == 's' && parse_sizes(optarg, sizes))
+            continue;
+        if (target == NULL || sscanf(optarg, "%d", target) != 1 || *target < 0)
+            log_info(true, usage);
+    }
+    if (sizes.empty())
+        parse_sizes("4k,64k,1m", sizes);
+    if (name_cnt == 0 || session_cnt < name_cnt)
+        log_info(true, "[ERROR] need at least one session per username.\n");
+
+    rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    vector<SAMPLE> samples(sizes.size());
+    for (int i = 0; i < sizes.size(); i++)
+        make_sample(samples[i], sizes[i]);
+
+    sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    inet_aton(argv[1], &server_address.sin_addr);
+
+    EVENT_LOOP loop;
+    if (loop_init(loop, LOOP_EPOLL) == -1)
+        log_info(true, "[ERROR] epoll_create1() error.\n");
+
+    STATS stats;
+    vector<SESSION *> sessions;
+    vector<SESSION *> by_fd;
+    vector<int> per_name(name_cnt, 0);
+    for (int i = 0; i < session_cnt; i++) {
+        SESSION *s = new SESSION();
+        s->name_id = i % name_cnt;
+        s->writer = per_name[s->name_id]++ < writer_cnt;
+        s->uploads_left = s->writer ? file_cnt : 0;
+
+        s->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (s->fd == -1 || connect(s->fd, (sockaddr *)&server_address, sizeof(server_address)) == -1)
+            log_info(true, "[ERROR] connect() error.\n");
+        int flag = 1;
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        set_no_blocking(s->fd);
+
+        char name[NAME_SIZE];
+        sprintf(name, "lguser%d", s->name_id);
+        frame_push(s->out, 0, 0, name, strlen(name));
+        limit_push(s->out, 0);
+        frame_push(s->out, 5, 0, "", 0);
+        if (loop_add(loop, s->fd, EV_READ | EV_WRITE) == -1)
+            log_info(true, "[ERROR] loop_add() error.\n");
+
+        if ((int)by_fd.size() <= s->fd)
+            by_fd.resize(s->fd + 1, NULL);
+        by_fd[s->fd] = s;
+        sessions.push_back(s);
+    }
+    for (int i = 0; i < name_cnt; i++) {
+        int writers = per_name[i] < writer_cnt ? per_name[i] : writer_cnt;
+        stats.expected += (uint64_t)writers * file_cnt * (per_name[i] - 1);
+    }
+
+    /* writers waiting for their next upload, earliest first */
+    typedef pair<double, SESSION *> WAKEUP;
+    priority_queue<WAKEUP, vector<WAKEUP>, greater<WAKEUP> > wakeups;
+    double begin = now_ms();
+    for (int i = 0; i < sessions.size(); i++) {
+        if (sessions[i]->writer && file_cnt > 0)
+            wakeups.push(make_pair(begin, sessions[i]));
+    }
+
+    double cpu_begin = pid > 0 ? cpu_seconds(pid) : -1;
+    int upload = 0;
+    vector<EVENT> ready;
+    while (stats.downloads < stats.expected || !wakeups.empty() || upload > 0) {
+        double now = now_ms();
+        if (now - begin > timeout * 1000.0) {
+            log_info(false, "[INFO] timeout, reporting partial results.\n");
+            break;
+        }
+
+        while (!wakeups.empty() && wakeups.top().first <= now) {
+            SESSION *s = wakeups.top().second;
+            wakeups.pop();
+            if (!start_upload(*s, &samples[stats.files.size() % samples.size()], stats)) {
+                wakeups.push(make_pair(now + 1, s));
+                break;
+            }
+            upload++;
+            if (!send_session(*s, stats))
+                log_info(true, "[ERROR] send() error.\n");
+        }
+
+        int wait = wakeups.empty() ? 1000 : (int)(wakeups.top().first - now) + 1;
+        if (loop_wait(loop, ready, wait) == -1)
+            log_info(true, "[ERROR] epoll_wait() error.\n");
+
+        for (int i = 0; i < ready.size(); i++) {
+            SESSION *s = by_fd[ready[i].fd];
+            int state = s->state;
+            if ((ready[i].events & EV_READ) && !recv_session(*s, stats))
+                log_info(true, "[ERROR] server closed a session.\n");
+            if (!send_session(*s, stats))
+                log_info(true, "[ERROR] send() error.\n");
+
+            if (state != 0 && s->state == 0) {
+                upload--;
+                if (s->uploads_left > 0)
+                    wakeups.push(make_pair(now_ms() + interval, s));
+            }
+        }
+    }
+
+    double elapsed = now_ms() - begin;
+    double cpu = cpu_begin >= 0 ? cpu_seconds(pid) - cpu_begin : -1;
+    report(stats, elapsed, cpu);
+    return stats.downloads == stats.expected ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <cstring>
+#include <string>
+
+/*
+    Counters and histograms are plain integers owned by one reactor thread,
+    other threads only read the text snapshot a shard publishes from time to
+    time, so the hot path never pays for atomics or locks.
+*/
+#define HIST_BUCKETS 40
+
+static inline uint64_t now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    Power of two buckets, bucket i counts values below 2^i, so percentiles
+    are rounded up to the next power of two but adding a value is a couple
+    of instructions.
+*/
+struct HISTOGRAM {
+    uint64_t count, sum, max;
+    uint64_t bucket[HIST_BUCKETS];
+
+    HISTOGRAM() {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+static inline void hist_add(HISTOGRAM& h, uint64_t val) {
+    int i = val == 0 ? 0 : 64 - __builtin_clzll(val);
+    h.bucket[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+    h.count++;
+    h.sum += val;
+    if (val > h.max)
+        h.max = val;
+}
+
+static inline uint64_t hist_percentile(HISTOGRAM& h, double p) {
+    uint64_t rank = (uint64_t)(p * h.count + 0.5), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h.bucket[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t bound = i == 0 ? 0 : (1ull << i) - 1;
+            return bound < h.max ? bound : h.max;
+        }
+    }
+    return h.max;
+}
+
+static inline void hist_format(std::string& out, const char *name, HISTOGRAM& h) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s count %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu\n", name,
+             (unsigned long long)h.count, (unsigned long long)(h.count ? h.sum / h.count : 0),
+             (unsigned long long)hist_percentile(h, 0.5), (unsigned long long)hist_percentile(h, 0.9),
+             (unsigned long long)hist_percentile(h, 0.99), (unsigned long long)h.max);
+    out += line;
+}
+
+/*
+    Per-connection counters, they move with the connection when it is handed
+    to another shard.
+*/
+struct CONN_STATS {
+    uint64_t bytes_in, bytes_out, frames_in, recv_eagain, send_eagain, uploads, downloads, superseded;
+
+    CONN_STATS() {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+static inline void conn_stats_add(CONN_STATS& dst, CONN_STATS& src) {
+    dst.bytes_in += src.bytes_in;
+    dst.bytes_out += src.bytes_out;
+    dst.frames_in += src.frames_in;
+    dst.recv_eagain += src.recv_eagain;
+    dst.send_eagain += src.send_eagain;
+    dst.uploads += src.uploads;
+    dst.downloads += src.downloads;
+    dst.superseded += src.superseded;
+}
+
+static inline void conn_stats_format(std::string& out, CONN_STATS& s) {
+    char line[256];
+    snprintf(line, sizeof(line), " in %llu out %llu frames %llu recv_eagain %llu send_eagain %llu uploads %llu downloads %llu superseded %llu",
+             (unsigned long long)s.bytes_in, (unsigned long long)s.bytes_out, (unsigned long long)s.frames_in,
+             (unsigned long long)s.recv_eagain, (unsigned long long)s.send_eagain, (unsigned long long)s.uploads,
+             (unsigned long long)s.downloads, (unsigned long long)s.superseded);
+    out += line;
+}
+
+/*
+    Per-shard totals, gone holds the counters of connections that exited on
+    this shard. Times are in microseconds.
+*/
+struct SHARD_STATS {
+    CONN_STATS gone;
+    uint64_t loops, accepted, exited, evicted, handoffs, throttled, cache_hits, cache_misses;
+    HISTOGRAM loop_us, upload_us, download_us, disk_us;
+
+    SHARD_STATS() {
+        this->loops = 0;
+        this->accepted = 0;
+        this->exited = 0;
+        this->evicted = 0;
+        this->handoffs = 0;
+        this->throttled = 0;
+        this->cache_hits = 0;
+        this->cache_misses = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <errno.h>
+#include <cstring>
+
+#define BUF_SIZE 1024
+#define FRAME_MAX (16 * 1024)
+#define RING_SIZE (64 * 1024)
+
+/*
+    frame on the wire, integers are big endian
+    +--------+-----------+-------+-------------+
+    | mode 1 | stream 4  | len 4 | payload len |
+    +--------+-----------+-------+-------------+
+    stream 0 is the connection itself, uploads use odd ids picked by the
+    client and downloads even ids picked by the server, so several transfers
+    can be interleaved on one connection.
+*/
+#define HEADER_SIZE 9
+#define FEATURE_RESUME 1
+#define FEATURE_DEFLATE 2
+#define PACK_BLOCK FRAME_MAX
+#define PACK_LEVEL 1
+#define PACK_PROBE 4
+#define SEGMENT_SIZE (256 * 1024)
+
+struct PACKAGE {
+    /*
+       mode
+       0: username
+       1: upload begin, filename, followed by 7 and 8
+       2: data, len 0 marks the end of the file
+       3: download begin, 8 byte size followed by the filename, the body
+          follows as 13 segments and a closing mode 2 frame
+       4: manifest entry, 8 byte size, 8 byte content hash, filename
+       5: manifest end, sent once after the username
+       7: chunk signatures of the upload, 4 byte len, 8 byte hash and 4 byte
+          crc32c each
+       8: signatures end
+       9: chunk indexes the server is missing, 4 bytes each
+      10: missing list end, the client then sends those chunks as mode 2
+      11: delta download, 8 byte size, 8 byte hash, filename, followed by
+          12 and 2 frames that rebuild the file from the client's copy
+      12: copy from the old copy, 8 byte offset, 4 byte len
+      13: segment of a download body, up to SEGMENT_SIZE raw bytes, only the
+          header is popped and the receiver reads the payload itself
+      14: download aborted, a newer version was published and is sent on
+          another stream, the receiver drops what it got
+      15: frame limit, 4 byte largest payload the sender accepts and 4 byte
+          feature flags, sent by the client after the username and answered
+          by the server. Until then both sides keep data frames within
+          BUF_SIZE
+      16: resumable download begin, 8 byte size, 8 byte hash, 8 byte offset,
+          filename, sent instead of 3 to clients with FEATURE_RESUME. The
+          segments start at offset, the bytes before it are the ones the
+          client reported with 17
+      17: partial copy, 8 byte size, 8 byte hash, 8 byte offset, filename,
+          the first offset bytes of that version kept from a download that
+          was cut short, sent with the manifest entries
+      18: deflated data, part of a zlib stream that inflates to exactly the
+          next chunk the server asked for, sent instead of 2 once both
+          sides have FEATURE_DEFLATE. A chunk is either all 2 or all 18
+      19: deflated block of a download, a zlib stream of up to PACK_BLOCK
+          bytes of the file. A full download to a client with
+          FEATURE_DEFLATE may be sent as 19 and plain 2 frames instead of 13
+          segments
+      20: upload aborted. From the server with the filename, the data of
+          that upload failed its checks and it was dropped, the client
+          answers with an empty 20 unless it already sent the closing
+          frame. From the client with no payload, it gives up the upload
+          before sending the rest. The chunks that arrived intact are kept
+          for the next upload of the name
+      21: download again, filename, sent by the client when a delta or
+          resumable download of the name did not match its hash. The
+          server forgets what it knew the client held of the name and
+          sends the current version in full
+    */
+    int mode, stream, len;
+    char buf[FRAME_MAX + 1];
+
+    PACKAGE() {
+        this->mode = -1;
+    }
+};
+
+/*
+    Byte ring used for per-connection input and output. head and tail only
+    grow, the index into data is taken modulo cap (a power of two), so
+    tail - head is always the number of buffered bytes.
+*/
+struct BUFFER {
+    char *data;
+    uint32_t cap, head, tail;
+
+    BUFFER(uint32_t cap = RING_SIZE) {
+        this->data = new char[cap];
+        this->cap = cap;
+        this->head = 0;
+        this->tail = 0;
+    }
+    ~BUFFER() {
+        delete[] this->data;
+    }
+
+private:
+    BUFFER(const BUFFER&);
+    BUFFER& operator=(const BUFFER&);
+};
+
+static inline uint32_t buf_size(BUFFER& b) {
+    return b.tail - b.head;
+}
+
+static inline uint32_t buf_space(BUFFER& b) {
+    return b.cap - buf_size(b);
+}
+
+static inline void buf_copy_in(BUFFER& b, const char *src, uint32_t len) {
+    uint32_t pos = b.tail & (b.cap - 1);
+    uint32_t first = len < b.cap - pos ? len : b.cap - pos;
+    memcpy(b.data + pos, src, first);
+    memcpy(b.data, src + first, len - first);
+    b.tail += len;
+}
+
+static inline void buf_peek(BUFFER& b, char *dst, uint32_t len) {
+    uint32_t pos = b.head & (b.cap - 1);
+    uint32_t first = len < b.cap - pos ? len : b.cap - pos;
+    memcpy(dst, b.data + pos, first);
+    memcpy(dst + first, b.data, len - first);
+}
+
+static inline void buf_read(BUFFER& b, char *dst, uint32_t len) {
+    buf_peek(b, dst, len);
+    b.head += len;
+}
+
+/*
+    Fills iov with the (at most two) contiguous pieces of the free space or of
+    the buffered data, returns how many pieces were used.
+*/
+static inline int buf_free_iov(BUFFER& b, iovec *iov) {
+    uint32_t space = buf_space(b), pos = b.tail & (b.cap - 1);
+    uint32_t first = space < b.cap - pos ? space : b.cap - pos;
+    iov[0].iov_base = b.data + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = b.data;
+    iov[1].iov_len = space - first;
+    return space - first ? 2 : 1;
+}
+
+static inline int buf_data_iov(BUFFER& b, iovec *iov) {
+    uint32_t size = buf_size(b), pos = b.head & (b.cap - 1);
+    uint32_t first = size < b.cap - pos ? size : b.cap - pos;
+    iov[0].iov_base = b.data + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = b.data;
+    iov[1].iov_len = size - first;
+    return size - first ? 2 : 1;
+}
+
+/*
+    recv()/send() as much as fits in one call. Same return convention as the
+    underlying syscall, a full input buffer or an empty output buffer returns
+    -1 with errno EAGAIN so callers treat it like a would-block.
+*/
+static inline ssize_t buf_recv(BUFFER& b, int fd) {
+    if (buf_space(b) == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    iovec iov[2];
+    int cnt = buf_free_iov(b, iov);
+    ssize_t len = readv(fd, iov, cnt);
+    if (len > 0)
+        b.tail += len;
+    return len;
+}
+
+static inline ssize_t buf_send(BUFFER& b, int fd, int flags = 0) {
+    if (buf_size(b) == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    iovec iov[2];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = buf_data_iov(b, iov);
+    ssize_t len = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+    if (len > 0)
+        b.head += len;
+    return len;
+}
+
+static inline bool frame_fits(BUFFER& b, int len) {
+    return buf_space(b) >= (uint32_t)(HEADER_SIZE + len);
+}
+
+/*
+    header_push() only writes the header, the caller checks the space and
+    sends the payload itself. frame_push() appends one frame, returns false
+    without touching the buffer if it does not fit.
+*/
+static inline void header_push(BUFFER& b, int mode, uint32_t stream, uint32_t len) {
+    char header[HEADER_SIZE];
+    uint32_t net_stream = htonl(stream), net_len = htonl(len);
+    header[0] = mode;
+    memcpy(header + 1, &net_stream, 4);
+    memcpy(header + 5, &net_len, 4);
+    buf_copy_in(b, header, HEADER_SIZE);
+}
+
+static inline bool frame_push(BUFFER& b, int mode, uint32_t stream, const char *payload, int len) {
+    if (len < 0 || len > FRAME_MAX || !frame_fits(b, len))
+        return false;
+
+    header_push(b, mode, stream, len);
+    buf_copy_in(b, payload, len);
+    return true;
+}
+
+static inline void put_u64(char *dst, uint64_t val) {
+    for (int i = 7; i >= 0; i--, val >>= 8)
+        dst[i] = val & 0xff;
+}
+
+static inline uint64_t get_u64(const char *src) {
+    uint64_t val = 0;
+    for (int i = 0; i < 8; i++)
+        val = val << 8 | (unsigned char)src[i];
+    return val;
+}
+
+/*
+    64-bit FNV-1a, only used to tell whether two copies of a file differ.
+*/
+#define HASH_INIT 14695981039346656037ull
+
+static inline uint64_t hash_update(uint64_t hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    return hash;
+}
+
+static inline bool manifest_push(BUFFER& b, const char *name, uint64_t size, uint64_t hash) {
+    char payload[16 + BUF_SIZE];
+    int name_len = strlen(name);
+    if (name_len > BUF_SIZE - 16)
+        return false;
+    put_u64(payload, size);
+    put_u64(payload + 8, hash);
+    memcpy(payload + 16, name, name_len);
+    return frame_push(b, 4, 0, payload, 16 + name_len);
+}
+
+/*
+    Deflated data is only sent if it saves an eighth, otherwise the other
+    side spends the inflate for nothing. Both sides stop trying a file
+    after PACK_PROBE misses in a row, it is most likely compressed already.
+*/
+static inline bool pack_saves(uint64_t packed, uint64_t len) {
+    return packed * 8 <= len * 7;
+}
+
+static inline bool partial_push(BUFFER& b, const char *name, uint64_t size, uint64_t hash, uint64_t off) {
+    char payload[24 + BUF_SIZE];
+    int name_len = strlen(name);
+    if (name_len > BUF_SIZE - 24)
+        return false;
+    put_u64(payload, size);
+    put_u64(payload + 8, hash);
+    put_u64(payload + 16, off);
+    memcpy(payload + 24, name, name_len);
+    return frame_push(b, 17, 0, payload, 24 + name_len);
+}
+
+static inline bool limit_push(BUFFER& b, uint32_t flags) {
+    char payload[8];
+    uint32_t net_max = htonl(FRAME_MAX), net_flags = htonl(flags);
+    memcpy(payload, &net_max, 4);
+    memcpy(payload + 4, &net_flags, 4);
+    return frame_push(b, 15, 0, payload, 8);
+}
+
+/*
+    A peer that predates the flags sends only the limit.
+*/
+static inline uint32_t limit_flags(PACKAGE& pkg) {
+    uint32_t net_flags;
+    if (pkg.len < 8)
+        return 0;
+    memcpy(&net_flags, pkg.buf + 4, 4);
+    return ntohl(net_flags);
+}
+
+static inline uint32_t limit_get(PACKAGE& pkg) {
+    uint32_t net_max;
+    memcpy(&net_max, pkg.buf, 4);
+    uint32_t max = ntohl(net_max);
+    return max < BUF_SIZE ? BUF_SIZE : max > FRAME_MAX ? FRAME_MAX : max;
+}
+
+/*
+    Size of the next data frames on fd, a quarter of what the congestion
+    window lets in flight rounded down to a power of two, within BUF_SIZE
+    and limit. A path with a small bandwidth-delay product keeps frames
+    short so the streams sharing it stay interleaved, a fast one gets
+    frames big enough that the per-frame work stops mattering.
+*/
+static inline uint32_t frame_target(int fd, uint32_t limit) {
+    tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (limit <= BUF_SIZE || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == -1)
+        return BUF_SIZE;
+
+    uint64_t bdp = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss / 4;
+    uint32_t len = BUF_SIZE;
+    while (len * 2 <= bdp && len * 2 <= limit)
+        len *= 2;
+    return len;
+}
+
+/*
+    Pops one complete frame into pkg, the payload is NUL terminated so names
+    can be used as C strings.
+    Returns 1 on success, 0 if the frame is still incomplete, -1 if the peer
+    sent a frame that can never be valid.
+*/
+static inline int frame_pop(BUFFER& b, PACKAGE& pkg) {
+    if (buf_size(b) < HEADER_SIZE)
+        return 0;
+
+    char header[HEADER_SIZE];
+    uint32_t net_stream, net_len;
+    buf_peek(b, header, HEADER_SIZE);
+    memcpy(&net_stream, header + 1, 4);
+    memcpy(&net_len, header + 5, 4);
+    uint32_t len = ntohl(net_len);
+    int mode = (unsigned char)header[0];
+
+    if (mode == 13) {
+        if (len > SEGMENT_SIZE)
+            return -1;
+        b.head += HEADER_SIZE;
+        pkg.mode = mode;
+        pkg.stream = ntohl(net_stream);
+        pkg.len = len;
+        return 1;
+    }
+
+    if (len > FRAME_MAX)
+        return -1;
+    if (buf_size(b) < HEADER_SIZE + len)
+        return 0;
+
+    b.head += HEADER_SIZE;
+    buf_peek(b, pkg.buf, len);
+    b.head += len;
+    pkg.buf[len] = '\0';
+    pkg.mode = mode;
+    pkg.stream = ntohl(net_stream);
+    pkg.len = len;
+    return 1;
+}
+
+#endif
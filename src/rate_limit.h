@@ -0,0 +1,85 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+/*
+    Byte token bucket. Transfers are charged after the fact, so tokens may
+    go negative and the next transfer waits until the debt is paid back,
+    which keeps the long run rate exact however big a single send or recv
+    was. An empty bucket opens again at BUCKET_STEP tokens, not at the
+    first one, so a throttled transfer moves in steps instead of waking
+    for every few bytes. A rate of 0 means no limit.
+*/
+#define BUCKET_BURST_MS 100
+#define BUCKET_BURST_MIN (64 * 1024)
+#define BUCKET_STEP (16 * 1024)
+
+struct TOKEN_BUCKET {
+    uint64_t rate, burst, last;
+    int64_t tokens;
+    bool empty;
+
+    TOKEN_BUCKET() {
+        this->rate = 0;
+        this->burst = 0;
+        this->last = 0;
+        this->tokens = 0;
+        this->empty = false;
+    }
+};
+
+/*
+    Limits of one username, shared by all of its sessions. weight scales
+    the share of each pass its connections get against the others.
+*/
+struct USER_LIMIT {
+    int weight;
+    uint64_t up_rate, down_rate;
+};
+
+static inline void bucket_init(TOKEN_BUCKET& b, uint64_t rate, uint64_t now) {
+    b.rate = rate;
+    b.burst = rate * BUCKET_BURST_MS / 1000;
+    if (b.burst < BUCKET_BURST_MIN)
+        b.burst = BUCKET_BURST_MIN;
+    b.tokens = b.burst;
+    b.last = now;
+}
+
+static inline void bucket_refill(TOKEN_BUCKET& b, uint64_t now) {
+    if (b.rate == 0 || now <= b.last)
+        return;
+    uint64_t add = (now - b.last) * b.rate / 1000000;
+    if (add == 0)
+        return;
+    b.last = now;
+    b.tokens = b.tokens + (int64_t)add > (int64_t)b.burst ? b.burst : b.tokens + add;
+}
+
+static inline bool bucket_open(TOKEN_BUCKET& b, uint64_t now) {
+    if (b.rate == 0)
+        return true;
+    bucket_refill(b, now);
+    if (b.tokens <= 0)
+        b.empty = true;
+    else if (b.empty && b.tokens >= BUCKET_STEP)
+        b.empty = false;
+    return !b.empty;
+}
+
+static inline void bucket_charge(TOKEN_BUCKET& b, uint64_t len) {
+    if (b.rate != 0)
+        b.tokens -= len;
+}
+
+/*
+    Microseconds until an empty bucket opens again.
+*/
+static inline uint64_t bucket_delay(TOKEN_BUCKET& b) {
+    if (b.rate == 0 || !b.empty)
+        return 0;
+    return (uint64_t)(BUCKET_STEP - b.tokens) * 1000000 / b.rate + 1;
+}
+
+#endif
@@ -3,6 +3,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -12,66 +17,479 @@
 #include <vector>
 #include <algorithm>
 #include <queue>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <zlib.h>
+#include "event_loop.h"
+#include "protocol.h"
+#include "chunker.h"
+#include "metrics.h"
+#include "disk_pool.h"
+#include "journal.h"
+#include "rate_limit.h"
 using namespace std;
 
 #define DEBUG
 
-#define BUF_SIZE 1024
+/*
+    Per-event messages such as every EAGAIN, compiled in only with -DTRACE
+    since printing them costs more than the syscalls they report on.
+*/
+#ifdef TRACE
+#define log_trace(msg) log_info(false, msg)
+#else
+#define log_trace(msg) ((void)0)
+#endif
+
 #define BACKLOG 20
+#define NAME_SIZE 30
+#define STREAM_QUANTUM (1024 * 1024)
+#define WEIGHT_DEFAULT 4
+#define WEIGHT_MAX 64
+#define MAX_DOWNLOADS 4
+#define PENDING_MAX 256
+#define STALL_TIMEOUT 30
+#define SWEEP_INTERVAL 1000
+#define STATS_INTERVAL 1000
+#define DISK_THREADS 4
+#define DISK_BATCH (256 * 1024)
+#define DISK_QUEUE (1024 * 1024)
+
+#define JOB_MKDIR 0
+#define JOB_OPEN_UPLOAD 1
+#define JOB_WRITE 2
+#define JOB_PUBLISH 3
+#define JOB_DISCARD 4
+#define JOB_OPEN_DOWNLOAD 5
+#define JOB_SUSPEND 6
+#define JOB_UNLINK 7
+
+#define SPAN_DATA 0
+#define SPAN_BASE 1
+#define SPAN_RESUME 2
 
+#define RING_FILE_BUF (1024 * 1024)
+#define RING_FILE_OPS 64
+
+#define CACHE_FILES 256
+#define CACHE_BYTES (256 * 1024 * 1024)
+
+#define JOURNAL_PATH ".journal"
+#define JOURNAL_TMP ".journal.tmp"
+#define SCAN_BLOCK (1024 * 1024)
+#define PACK_MAX (64 * 1024 * 1024)
+#define PACK_DEFLATED 0x80000000u
+
+/*
+    The published version of a file. Uploads never touch it, they build a
+    new version next to it and replace it with rename(), so a download that
+    already opened the old one keeps reading it until it is done.
+*/
 struct FILE_STATE {
-    /* 
-        mode
-        0: idle
-        1: read
-        2: write
-    */
     char name[30];
-    int mode;
+    uint64_t size, hash, prev_size, prev_hash;
+    vector<CHUNK> chunks, prev_chunks;
 
     FILE_STATE() {}
-    FILE_STATE(char *name, int mode) {
+    FILE_STATE(char *name) {
         strcpy(this->name, name);
-        this->mode = mode;
+        this->size = 0;
+        this->hash = 0;
+        this->prev_size = 0;
+        this->prev_hash = 0;
+    }
+};
+
+struct MANIFEST_ENTRY {
+    uint64_t size, hash;
+};
+
+/*
+    The first off bytes of version that a client kept from a download cut
+    short, reported with mode 17 at login.
+*/
+struct PARTIAL_COPY {
+    MANIFEST_ENTRY version;
+    uint64_t off;
+};
+
+/*
+    The .part file of an upload whose session went away, holding its first
+    chunks back to back. The next upload of the name copies the chunks it
+    shares with it instead of having them sent again.
+*/
+struct RESUME_FILE {
+    char path[100];
+    std::vector<CHUNK> chunks;
+};
+
+struct USER;
+struct FOLDER;
+struct SERVER;
+struct FILE_JOB;
+
+/*
+    One published version of a file, shared by every download of that
+    version on the shard instead of each opening and reading it. Delta
+    downloads copy their data frames out of map, mapped on first use while
+    the shard's mapped bytes stay under CACHE_BYTES. An entry nobody uses
+    waits in SERVER::idle_files until it is pushed out by CACHE_FILES or
+    CACHE_BYTES. A retired entry was replaced by a newer version and is
+    freed by its last user.
+
+    packed is the file deflated once for every FEATURE_DEFLATE download,
+    records of a 4 byte header, PACK_DEFLATED or'ed with the length, and
+    that many bytes, each a mode 19 or mode 2 frame as it is. It counts
+    against CACHE_BYTES, pack_tried is set once it was attempted, an empty
+    packed then means the file does not compress.
+*/
+struct CACHED_FILE {
+    FOLDER *folder;
+    char name[30];
+    MANIFEST_ENTRY version;
+    int fd, refs;
+    off_t size;
+    char *map;
+    string packed;
+    bool retired, pack_tried;
+    list<CACHED_FILE *>::iterator idle_pos;
+};
+
+/*
+    An upload is announced by its chunk signatures. Chunks the old copy
+    already has are copied from base_fd, the rest arrive as mode 2 data, and
+    the result is written to its own .part file that replaces the old one at
+    the end. base_chunks is the chunk list of the version base_fd was opened
+    at, so a version published in between does not mix them up.
+
+    Chunks left behind by an interrupted upload of the name are copied from
+    resume_fd the same way, resumed marks which sigs come from there, and
+    resume_chunks is kept so the file can go back to the folder. Every
+    chunk is checked against the crc of its signature, crc is the running
+    one of the chunk being received. Chunks sent as mode 18 go through
+    zin, z_busy is set while one is halfway and z_left is how much of it
+    is still to come. replied is set once the missing list went out, only
+    then may the client send data.
+
+    The file work is done by a disk worker, the reactor only appends to
+    batch and submits it, so wr_fd, base_fd, resume_fd, wr_off and wr_hash
+    belong to the worker until the last job of the upload is back. user is
+    NULL once the session is gone.
+*/
+struct UPLOAD {
+    int id;
+    char name[30], tmp_path[100], resume_path[100];
+    USER *user;
+    FOLDER *folder;
+    int wr_fd, base_fd, resume_fd;
+    uint64_t wr_size, wr_off, wr_hash, start;
+    vector<CHUNK> sigs, base_chunks, resume_chunks;
+    vector<bool> need, resumed;
+    vector<uint32_t> need_list;
+    bool sig_done, closing, replied;
+    size_t idx, need_sent;
+    uint32_t left, crc, z_left;
+    z_stream *zin;
+    bool z_busy;
+    FILE_JOB *batch;
+
+    UPLOAD() {
+        this->zin = NULL;
+        this->z_busy = false;
+        this->resume_path[0] = '\0';
+        this->user = NULL;
+        this->folder = NULL;
+        this->wr_fd = -1;
+        this->base_fd = -1;
+        this->resume_fd = -1;
+        this->sig_done = false;
+        this->closing = false;
+        this->replied = false;
+        this->batch = NULL;
+    }
+    ~UPLOAD() {
+        if (this->zin != NULL) {
+            inflateEnd(this->zin);
+            delete this->zin;
+        }
+    }
+};
+
+/*
+    A download is sent as raw segments with sendfile(), or, when the client
+    is known to hold the previous version, as a delta of copy and data
+    frames against that copy. A client with FEATURE_DEFLATE gets the
+    file's packed form instead of segments when there is one, pack_pos is
+    how far into it the download is. The file is opened by a disk worker,
+    the download is skipped until ready and announced by its first step.
+*/
+struct DOWNLOAD {
+    int id;
+    char name[30];
+    USER *user;
+    CACHED_FILE *file;
+    int fd;
+    off_t off, size;
+    bool delta, ready, announced, stale, packed;
+    size_t pack_pos;
+    vector<CHUNK> chunks;
+    unordered_map<uint64_t, CHUNK> base;
+    size_t idx;
+    uint32_t chunk_off;
+    MANIFEST_ENTRY version;
+    uint64_t start;
+
+    DOWNLOAD() {
+        this->user = NULL;
+        this->file = NULL;
+        this->fd = -1;
+        this->off = 0;
+        this->size = 0;
+        this->delta = false;
+        this->ready = false;
+        this->announced = false;
+        this->stale = false;
+        this->packed = false;
+        this->pack_pos = 0;
+        this->idx = 0;
+        this->chunk_off = 0;
     }
 };
 
+/*
+    A piece of file work for the disk pool. A write appends spans to the
+    .part file in order, a SPAN_DATA span takes its bytes from data, the
+    others copy the chunk at off of the old copy or of the resume file and
+    check it against crc first. bytes is how much of data counts against
+    the user's DISK_QUEUE. resume_path is the resume file to open with the
+    upload or to remove once it is done.
+*/
+struct SPAN {
+    int src;
+    int64_t off;
+    uint32_t len, crc;
+};
+
+struct FILE_JOB {
+    DISK_JOB job;
+    int op, res, fd;
+    SERVER *server;
+    UPLOAD *up;
+    DOWNLOAD *dl;
+    char path[100], resume_path[100];
+    string data;
+    vector<SPAN> spans;
+    uint64_t bytes, len, start;
+    off_t size;
+    bool pack;
+};
+
+/*
+    publishing counts the renames queued on the disk pool per name, until
+    they are back the on-disk copy may be newer than its FILE_STATE.
+    up and down limit the bytes all sessions of the username receive and
+    send, throttled is set while the folder waits in SERVER::throttled for
+    its buckets to refill. resume keeps at most one interrupted upload per
+    name, an upload of the name takes it over.
+*/
 struct FOLDER {
     char name[30];
-    vector<FILE_STATE> files;
+    unordered_map<string, FILE_STATE> files;
+    unordered_map<string, int> publishing;
+    unordered_map<string, CACHED_FILE *> cache;
+    unordered_map<string, RESUME_FILE> resume;
+    vector<USER *> sessions;
+    uint64_t next_version;
+    int weight;
+    TOKEN_BUCKET up, down;
+    bool throttled;
 
     FOLDER() {}
     FOLDER(char *name) {
         strcpy(this->name, name);
+        this->next_version = 0;
+        this->weight = WEIGHT_DEFAULT;
+        this->throttled = false;
     }
 };
 
-struct PACKAGE {
+struct USER {
+    char name[30];
+    int fd;
+    unordered_map<int, UPLOAD *> uploads;
+    queue<UPLOAD *> replies;
+    vector<DOWNLOAD *> downloads;
+    size_t rr;
+    int next_stream;
+    DOWNLOAD *seg;
+    off_t seg_left;
+    queue<string> rd_list;
+    unordered_set<string> rd_names;
+    unordered_map<string, MANIFEST_ENTRY> held;
+    unordered_map<string, PARTIAL_COPY> partial;
+    bool syncing, overflow, resume_ok, deflate_ok;
+    FOLDER *folder;
+    int session_id;
+    PACKAGE cur_case;
+    BUFFER in, out;
+    bool can_read, can_write, active, rd_interest, wr_interest, eof;
+    CONN_STATS stats;
+
+    /*
+        peer_frame is the largest data frame the client accepts, BUF_SIZE
+        until it sends mode 15. corked is set while a send_output() pass
+        holds back partial packets so a segment header, its sendfile() body
+        and the next header leave as full packets.
+    */
+    uint32_t peer_frame;
+    bool corked;
+
+    /*
+        rejects holds the mode 20 frames still to send for uploads that
+        failed their checks, stream id and filename. Data the client sent
+        on a stream in rejected before it saw the frame is ignored, the
+        stream ends with the client's mode 20 or closing frame.
+    */
+    queue<pair<int, string>> rejects;
+    unordered_set<int> rejected;
+
+    /*
+        vtime is the traffic of the user divided by its weight, the active
+        users of a pass are served lowest vtime first so a light session
+        is not queued behind bulk ones. charged_in and charged_out are the
+        byte counts already charged to vtime and the folder's buckets.
+    */
+    uint64_t vtime, charged_in, charged_out;
+
+    /*
+        stall_since is when the user started waiting for the socket with
+        something to send, 0 again once a send makes progress. A user stuck
+        for longer than the stall timeout is marked evict and dropped by
+        serve_user().
+    */
+    uint64_t stall_since;
+    bool evict;
+
+    /*
+        disk_queued is the upload data handed to the disk pool and not yet
+        written, while it is above DISK_QUEUE the pending frame waits with
+        disk_wait set. disk_error is set when a job of the user failed.
+    */
+    uint64_t disk_queued;
+    bool disk_wait, disk_error;
+
     /*
-       mode
-       0: username
-       1: filename
-       2: data
+        With -e uring the reads and writes of in and out are queued on the
+        ring, the iovecs have to outlive the submission.
     */
-    int mode, len;
-    char buf[BUF_SIZE];
+    bool recv_busy, send_busy, poll_busy;
+    iovec rd_iov[2], wr_iov[2];
+    msghdr wr_msg;
+    USER *next;
 
-    PACKAGE() {
-        this->mode = -1;
+    USER() {
+        this->fd = -1;
+        this->folder = NULL;
+        this->session_id = -1;
+        this->syncing = false;
+        this->overflow = false;
+        this->resume_ok = false;
+        this->deflate_ok = false;
+        this->rr = 0;
+        this->next_stream = 2;
+        this->seg = NULL;
+        this->seg_left = 0;
+        this->can_read = false;
+        this->can_write = false;
+        this->active = false;
+        this->rd_interest = true;
+        this->wr_interest = false;
+        this->eof = false;
+        this->peer_frame = BUF_SIZE;
+        this->corked = false;
+        this->vtime = 0;
+        this->charged_in = 0;
+        this->charged_out = 0;
+        this->stall_since = 0;
+        this->evict = false;
+        this->disk_queued = 0;
+        this->disk_wait = false;
+        this->disk_error = false;
+        this->recv_busy = false;
+        this->send_busy = false;
+        this->poll_busy = false;
+        this->next = NULL;
     }
 };
 
-struct USER {
-    char name[30], rd_name[30], wr_name[30];
-    int fd;
-    FILE *rd_fd, *wr_fd;
-    queue<char *> rd_list;
-    PACKAGE cur_case, up_package;
+/*
+    One reactor. With -t N there are N of them, one per thread, each with its
+    own SO_REUSEPORT listener. A folder only lives on the shard picked by
+    shard_of() so all sessions of a username meet on the same thread, logins
+    that land elsewhere are pushed to the owner through its inbox.
+*/
+struct SERVER {
+    int id, fd, event_fd;
+    EVENT_LOOP loop;
+    vector<USER *> users, active;
+    unordered_map<string, FOLDER> folders;
+    vector<SERVER *> *shards;
+    atomic<USER *> inbox;
+    DISK_POOL *disk;
+    JOURNAL *journal;
+    atomic<DISK_JOB *> disk_done;
+    list<CACHED_FILE *> idle_files;
+    int cache_files;
+    uint64_t cache_bytes;
 
-    USER() {
+    /*
+        limits is the -l table shared by all shards, "*" is the default.
+        vclock is the lowest vtime of the last pass, a user coming back
+        from idle starts there instead of cashing in the time it was away.
+        Folders out of tokens wait in throttled until next_refill.
+    */
+    unordered_map<string, USER_LIMIT> *limits;
+    uint64_t vclock, next_refill;
+    vector<FOLDER *> throttled;
+
+    /*
+        With -s every shard rewrites report once per STATS_INTERVAL, shard 0
+        also owns the UNIX socket in stats_fd and answers each connection
+        with the reports of all shards.
+    */
+    SHARD_STATS stats;
+    bool stats_on;
+    int stats_fd;
+    uint64_t next_report, next_sweep, stall_us;
+    string report;
+    int sock_buf;
+    mutex report_lock;
+
+    SERVER() {
+        this->id = 0;
         this->fd = -1;
-        this->rd_fd = NULL;
-        this->wr_fd = NULL;
+        this->event_fd = -1;
+        this->shards = NULL;
+        this->inbox = NULL;
+        this->disk = NULL;
+        this->journal = NULL;
+        this->disk_done = NULL;
+        this->cache_files = 0;
+        this->cache_bytes = 0;
+        this->limits = NULL;
+        this->vclock = 0;
+        this->next_refill = UINT64_MAX;
+        this->stats_on = false;
+        this->stats_fd = -1;
+        this->next_report = 0;
+        this->next_sweep = 0;
+        this->stall_us = (uint64_t)STALL_TIMEOUT * 1000000;
+        this->sock_buf = 0;
     }
 };
 
@@ -94,260 +512,2473 @@ void set_no_blocking(int fd) {
         log_info(true, "[ERROR] failed to set fd flags.\n");
 }
 
-void change_file_state(vector<FOLDER>& folders, char *folder_name, char *file_name, int mode) {
-    int folder_id = -1;
+uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+bool write_all(int fd, const char *data, uint32_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+    With -e uring each disk worker also gets a ring of its own for the
+    writes of uploads. Chunks copied from the old copy or the resume file
+    are read into buf, registered with the ring so READ_FIXED and
+    WRITE_FIXED do not pin its pages on every call, and written out of it
+    again. ok is false if the ring could not be set up, the worker then
+    keeps using pread() and write().
+*/
+struct FILE_RING {
+    URING ring;
+    char *buf;
+    bool ok;
+};
+
+FILE_RING *worker_ring() {
+    static thread_local FILE_RING *ring = NULL;
+    if (ring != NULL)
+        return ring->ok ? ring : NULL;
+
+    ring = new FILE_RING();
+    ring->buf = (char *)mmap(NULL, RING_FILE_BUF, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->ok = ring->buf != MAP_FAILED && uring_init(ring->ring, RING_FILE_OPS) == 0 &&
+               uring_register_buffer(ring->ring, ring->buf, RING_FILE_BUF) == 0;
+    if (!ring->ok)
+        log_info(false, "[INFO] disk worker ring setup error, using write() instead.\n");
+    return ring->ok ? ring : NULL;
+}
+
+/*
+    write_spans() through the worker's ring. The spans go in rounds of up to
+    RING_FILE_OPS, the copies of a round are read into buf with one
+    io_uring_enter() and checked, then all writes of the round are queued
+    at their offsets in the .part file and submitted with another. Data
+    spans are written straight from the batch, copying them into buf first
+    would cost more than the pinning it saves.
+*/
+bool ring_spans(FILE_RING& ring, FILE_JOB& job) {
+    UPLOAD& up = *job.up;
+    const char *data = job.data.data();
+    int res[RING_FILE_OPS];
+    uint32_t slot[RING_FILE_OPS];
+
+    for (size_t i = 0; i < job.spans.size();) {
+        size_t end = i;
+        uint32_t used = 0, reads = 0;
+        for (; end < job.spans.size() && end - i < RING_FILE_OPS; end++) {
+            SPAN& span = job.spans[end];
+            if (span.src == SPAN_DATA)
+                continue;
+            if (used + span.len > RING_FILE_BUF)
+                break;
+            io_uring_sqe *sqe = uring_sqe(ring.ring, span.src == SPAN_BASE ? up.base_fd : up.resume_fd, 0);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = (uint64_t)(ring.buf + used);
+            sqe->len = span.len;
+            sqe->off = span.off;
+            sqe->user_data = end - i;
+            slot[end - i] = used;
+            used += span.len;
+            reads++;
+        }
+        if (reads > 0 && uring_run(ring.ring, reads, res) == -1)
+            return false;
+
+        for (size_t k = i; k < end; k++) {
+            SPAN& span = job.spans[k];
+            if (span.src != SPAN_DATA && (res[k - i] != (int)span.len || crc32c_update(0, ring.buf + slot[k - i], span.len) != span.crc))
+                return false;
+        }
+
+        for (size_t k = i; k < end; k++) {
+            SPAN& span = job.spans[k];
+            const char *src = span.src == SPAN_DATA ? data : ring.buf + slot[k - i];
+            io_uring_sqe *sqe = uring_sqe(ring.ring, up.wr_fd, 0);
+            sqe->opcode = span.src == SPAN_DATA ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+            sqe->addr = (uint64_t)src;
+            sqe->len = span.len;
+            sqe->off = up.wr_off;
+            sqe->user_data = k - i;
+            up.wr_off += span.len;
+            up.wr_hash = hash_update(up.wr_hash, src, span.len);
+            if (span.src == SPAN_DATA)
+                data += span.len;
+        }
+        if (uring_run(ring.ring, end - i, res) == -1)
+            return false;
+        for (size_t k = i; k < end; k++) {
+            if (res[k - i] != (int)job.spans[k].len)
+                return false;
+        }
+        i = end;
+    }
+    return true;
+}
+
+/*
+    Runs on a disk worker, appends the spans of a write to the .part file
+    and folds them into the content hash. A copied chunk whose crc does not
+    match is not used, the failed write closes wr_fd so nothing after it
+    lands at the wrong offset.
+*/
+bool write_spans(FILE_JOB& job) {
+    UPLOAD& up = *job.up;
+    char chunk[CHUNK_MAX];
+    const char *data = job.data.data();
+
+    if (up.wr_fd == -1)
+        return false;
+    FILE_RING *ring = job.server->loop.backend == LOOP_URING ? worker_ring() : NULL;
+    if (ring != NULL) {
+        if (ring_spans(*ring, job))
+            return true;
+        close(up.wr_fd);
+        up.wr_fd = -1;
+        return false;
+    }
+    for (int i = 0; i < job.spans.size(); i++) {
+        SPAN& span = job.spans[i];
+        const char *src = data;
+        int fd = span.src == SPAN_BASE ? up.base_fd : up.resume_fd;
+        if (span.src == SPAN_DATA)
+            data += span.len;
+        else if (pread(fd, chunk, span.len, span.off) == span.len && crc32c_update(0, chunk, span.len) == span.crc)
+            src = chunk;
+        else
+            src = NULL;
+        if (src == NULL || !write_all(up.wr_fd, src, span.len)) {
+            close(up.wr_fd);
+            up.wr_fd = -1;
+            return false;
+        }
+        up.wr_off += span.len;
+        up.wr_hash = hash_update(up.wr_hash, src, span.len);
+    }
+    return true;
+}
+
+/*
+    Runs on a disk worker, deflates the file at fd block by block into out
+    in the CACHED_FILE::packed layout. A block that does not get smaller is
+    kept as it is. Returns false, leaving out empty, for a file that is
+    too big or stops saving after PACK_PROBE such blocks in a row.
+*/
+bool pack_file(int fd, off_t size, string& out) {
+    char block[PACK_BLOCK];
+    Bytef packed[PACK_BLOCK + 64];
+    int misses = 0;
+    out.clear();
+    if (size == 0 || size > PACK_MAX || compressBound(PACK_BLOCK) > sizeof(packed))
+        return false;
+
+    for (off_t off = 0; off < size;) {
+        uint32_t len = size - off < PACK_BLOCK ? size - off : PACK_BLOCK;
+        uLongf packed_len = sizeof(packed);
+        if (pread(fd, block, len, off) != len || compress2(packed, &packed_len, (Bytef *)block, len, PACK_LEVEL) != Z_OK)
+            break;
+        uint32_t head = len;
+        const char *src = block;
+        if (pack_saves(packed_len, len)) {
+            head = packed_len | PACK_DEFLATED;
+            src = (char *)packed;
+            misses = 0;
+        } else if (++misses >= PACK_PROBE && !pack_saves(out.size(), off + len))
+            break;
+        out.append((char *)&head, 4);
+        out.append(src, head & ~PACK_DEFLATED);
+        off += len;
+        if (off == size && pack_saves(out.size(), size))
+            return true;
+    }
+    out.clear();
+    return false;
+}
+
+/*
+    Runs on a disk worker after the rename, records the new version with
+    the inode and mtime of the renamed file so the next start can trust it
+    without reading the file.
+*/
+void journal_upload(FILE_JOB& job) {
+    UPLOAD& up = *job.up;
+    struct stat st;
+    if (job.server->journal == NULL || fstat(job.fd, &st) == -1)
+        return;
+
+    JOURNAL_RECORD rec;
+    rec.folder = up.folder->name;
+    rec.name = up.name;
+    rec.size = up.wr_size;
+    rec.hash = up.wr_hash;
+    rec.ino = st.st_ino;
+    rec.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    rec.chunks = up.sigs;
+    if (!journal_append(*job.server->journal, rec))
+        log_info(false, "[INFO] journal write error, left to the scan on next start.\n");
+}
+
+void run_job(DISK_JOB& disk_job) {
+    FILE_JOB& job = *(FILE_JOB *)disk_job.ctx;
+    UPLOAD *up = job.up;
+    job.res = 0;
+
+    if (job.op == JOB_MKDIR) {
+        mkdir(job.path, 0777);
+    } else if (job.op == JOB_OPEN_UPLOAD) {
+        up->wr_fd = open(up->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job.path[0] != '\0')
+            up->base_fd = open(job.path, O_RDONLY);
+        if (job.resume_path[0] != '\0')
+            up->resume_fd = open(job.resume_path, O_RDONLY);
+        if (up->wr_fd == -1 || (job.path[0] != '\0' && up->base_fd == -1) ||
+            (job.resume_path[0] != '\0' && up->resume_fd == -1))
+            job.res = -1;
+    } else if (job.op == JOB_WRITE) {
+        if (!write_spans(job))
+            job.res = -1;
+    } else if (job.op == JOB_PUBLISH) {
+        if (!write_spans(job) || close(up->wr_fd) != 0 || rename(up->tmp_path, job.path) == -1) {
+            unlink(up->tmp_path);
+            job.res = -1;
+        } else {
+            job.fd = open(job.path, O_RDONLY);
+            if (job.fd != -1)
+                journal_upload(job);
+            if (job.fd != -1 && job.pack)
+                pack_file(job.fd, up->wr_size, job.data);
+        }
+        up->wr_fd = -1;
+    } else if (job.op == JOB_DISCARD) {
+        if (up->wr_fd != -1)
+            close(up->wr_fd);
+        unlink(up->tmp_path);
+        up->wr_fd = -1;
+    } else if (job.op == JOB_SUSPEND) {
+        if (!write_spans(job) || ftruncate(up->wr_fd, job.size) == -1 || close(up->wr_fd) != 0) {
+            unlink(up->tmp_path);
+            job.res = -1;
+        }
+        up->wr_fd = -1;
+    } else if (job.op == JOB_UNLINK) {
+        unlink(job.path);
+    } else if (job.op == JOB_OPEN_DOWNLOAD) {
+        struct stat st;
+        job.res = open(job.path, O_RDONLY);
+        if (job.res != -1 && fstat(job.res, &st) == -1) {
+            close(job.res);
+            job.res = -1;
+        }
+        job.size = job.res == -1 ? 0 : st.st_size;
+        if (job.res != -1 && job.pack)
+            pack_file(job.res, job.size, job.data);
+    }
+
+    if (up != NULL && (job.op == JOB_PUBLISH || job.op == JOB_DISCARD || job.op == JOB_SUSPEND)) {
+        if (up->base_fd != -1)
+            close(up->base_fd);
+        if (up->resume_fd != -1)
+            close(up->resume_fd);
+        if (job.resume_path[0] != '\0')
+            unlink(job.resume_path);
+        up->base_fd = -1;
+        up->resume_fd = -1;
+    }
+}
+
+FILE_JOB *new_job(SERVER& server, int op) {
+    FILE_JOB *job = new FILE_JOB();
+    job->job.run = run_job;
+    job->job.ctx = job;
+    job->job.done = &server.disk_done;
+    job->job.wake_fd = server.event_fd;
+    job->op = op;
+    job->res = 0;
+    job->fd = -1;
+    job->server = &server;
+    job->up = NULL;
+    job->dl = NULL;
+    job->path[0] = '\0';
+    job->resume_path[0] = '\0';
+    job->bytes = 0;
+    job->len = 0;
+    job->size = 0;
+    job->pack = false;
+    return job;
+}
+
+/*
+    Jobs of one folder go to the same worker, so its renames, opens and
+    writes happen in the order they were submitted.
+*/
+void submit_job(SERVER& server, FOLDER& folder, FILE_JOB *job) {
+    job->start = now_us();
+    disk_submit(*server.disk, name_hash(folder.name), &job->job);
+}
+
+void cache_free(SERVER& server, CACHED_FILE *file) {
+    if (file->map != NULL) {
+        munmap(file->map, file->size);
+        server.cache_bytes -= file->size;
+    }
+    server.cache_bytes -= file->packed.size();
+    close(file->fd);
+    server.cache_files--;
+    delete file;
+}
+
+/*
+    Takes the entry out of its folder, it is freed now if unused or else by
+    its last user.
+*/
+void cache_retire(SERVER& server, CACHED_FILE *file) {
+    file->folder->cache.erase(file->name);
+    file->retired = true;
+    if (file->refs == 0) {
+        server.idle_files.erase(file->idle_pos);
+        cache_free(server, file);
+    }
+}
+
+/*
+    Drops unused entries, oldest first, until the limits leave room for
+    extra more mapped bytes.
+*/
+void cache_trim(SERVER& server, uint64_t extra) {
+    while ((server.cache_files > CACHE_FILES || server.cache_bytes + extra > CACHE_BYTES) && !server.idle_files.empty())
+        cache_retire(server, server.idle_files.back());
+}
+
+/*
+    Returns the entry of name with a reference taken if it holds version.
+*/
+CACHED_FILE *cache_get(SERVER& server, FOLDER& folder, const char *name, MANIFEST_ENTRY& version) {
+    unordered_map<string, CACHED_FILE *>::iterator it = folder.cache.find(name);
+    if (it == folder.cache.end() || it->second->version.size != version.size || it->second->version.hash != version.hash)
+        return NULL;
+    CACHED_FILE *file = it->second;
+    if (file->refs++ == 0)
+        server.idle_files.erase(file->idle_pos);
+    return file;
+}
+
+void cache_put(SERVER& server, CACHED_FILE *file) {
+    if (--file->refs > 0)
+        return;
+    if (file->retired) {
+        cache_free(server, file);
+        return;
+    }
+    server.idle_files.push_front(file);
+    file->idle_pos = server.idle_files.begin();
+    cache_trim(server, 0);
+}
+
+/*
+    Wraps a new fd of name opened at version, with one reference taken. It
+    becomes the folder's entry only if version is still the published one,
+    otherwise it is freed by its last user.
+*/
+CACHED_FILE *cache_add(SERVER& server, FOLDER& folder, const char *name, MANIFEST_ENTRY& version, int fd, off_t size) {
+    CACHED_FILE *file = new CACHED_FILE();
+    file->folder = &folder;
+    strcpy(file->name, name);
+    file->version = version;
+    file->fd = fd;
+    file->refs = 1;
+    file->size = size;
+    file->map = NULL;
+    file->retired = true;
+    file->pack_tried = false;
+    server.cache_files++;
+
+    unordered_map<string, FILE_STATE>::iterator state = folder.files.find(name);
+    if (state != folder.files.end() && state->second.size == version.size && state->second.hash == version.hash) {
+        unordered_map<string, CACHED_FILE *>::iterator old = folder.cache.find(name);
+        if (old != folder.cache.end())
+            cache_retire(server, old->second);
+        folder.cache[name] = file;
+        file->retired = false;
+    }
+    return file;
+}
+
+/*
+    Gives the entry the packed form a disk worker made of it, if it fits
+    in CACHE_BYTES.
+*/
+void cache_pack(SERVER& server, CACHED_FILE *file, string& packed) {
+    if (file->pack_tried)
+        return;
+    file->pack_tried = true;
+    cache_trim(server, packed.size());
+    if (server.cache_bytes + packed.size() > CACHE_BYTES)
+        return;
+    file->packed.swap(packed);
+    server.cache_bytes += file->packed.size();
+}
+
+char *cache_map(SERVER& server, CACHED_FILE& file) {
+    if (file.map != NULL || file.size == 0)
+        return file.map;
+    cache_trim(server, file.size);
+    if (server.cache_bytes + file.size > CACHE_BYTES)
+        return NULL;
+    void *map = mmap(NULL, file.size, PROT_READ, MAP_SHARED, file.fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    file.map = (char *)map;
+    server.cache_bytes += file.size;
+    return file.map;
+}
+
+void join_folder(FOLDER *folder, USER& user) {
+    user.folder = folder;
+    user.session_id = folder->sessions.size();
+    folder->sessions.push_back(&user);
+}
+
+void leave_folder(USER& user) {
+    vector<USER *>& sessions = user.folder->sessions;
+    sessions[user.session_id] = sessions.back();
+    sessions[user.session_id]->session_id = user.session_id;
+    sessions.pop_back();
+    user.session_id = -1;
+}
+
+/*
+    Makes file the resume file of name, the one it replaces is removed
+    behind the jobs that may still read it.
+*/
+void keep_resume(SERVER& server, FOLDER& folder, const char *name, RESUME_FILE& file) {
+    unordered_map<string, RESUME_FILE>::iterator it = folder.resume.find(name);
+    if (it != folder.resume.end()) {
+        FILE_JOB *job = new_job(server, JOB_UNLINK);
+        strcpy(job->path, it->second.path);
+        submit_job(server, folder, job);
+    }
+    folder.resume[name] = file;
+}
+
+/*
+    Queues the end of an upload that will not be published behind the jobs
+    still in flight, the upload is freed when it is back. If whole chunks
+    arrived, the pending batch is still written and the .part file cut
+    back to them is kept as the resume file of the name, otherwise it is
+    removed and a resume file the upload took over goes back to the
+    folder, or is removed too if it holds no chunks. The resume file is listed right away, an upload of the name
+    that starts before the job is back opens it behind the cut anyway. An
+    upload that is being published is left to its rename.
+*/
+void stop_upload(SERVER& server, UPLOAD *up) {
+    if (up->closing)
+        return;
+
+    FILE_JOB *job = up->batch != NULL ? up->batch : new_job(server, JOB_WRITE);
+    job->up = up;
+    up->batch = NULL;
+    up->closing = true;
+    if (up->sig_done && up->idx > 0) {
+        job->op = JOB_SUSPEND;
+        job->size = up->wr_size;
+        if (up->idx < up->sigs.size())
+            job->size -= up->sigs[up->idx].len - up->left;
+        strcpy(job->resume_path, up->resume_path);
+
+        RESUME_FILE file;
+        strcpy(file.path, up->tmp_path);
+        file.chunks.assign(up->sigs.begin(), up->sigs.begin() + up->idx);
+        uint64_t off = 0;
+        for (int i = 0; i < file.chunks.size(); i++) {
+            file.chunks[i].off = off;
+            off += file.chunks[i].len;
+        }
+        keep_resume(server, *up->folder, up->name, file);
+    } else {
+        job->op = JOB_DISCARD;
+        job->data.clear();
+        job->spans.clear();
+        if (up->resume_path[0] != '\0' && !up->resume_chunks.empty()) {
+            RESUME_FILE file;
+            strcpy(file.path, up->resume_path);
+            file.chunks.swap(up->resume_chunks);
+            keep_resume(server, *up->folder, up->name, file);
+        } else if (up->resume_path[0] != '\0')
+            strcpy(job->resume_path, up->resume_path);
+    }
+    submit_job(server, *up->folder, job);
+}
+
+void close_upload(SERVER& server, UPLOAD *up) {
+    up->user = NULL;
+    stop_upload(server, up);
+}
+
+/*
+    A download whose open is still in flight is freed when the open is
+    back.
+*/
+void close_download(SERVER& server, DOWNLOAD *dl) {
+    dl->user = NULL;
+    if (!dl->ready)
+        return;
+    if (dl->file != NULL)
+        cache_put(server, dl->file);
+    delete dl;
+}
+
+/*
+    Gives an opened download its file, a delta is only sent if the file
+    is the version the delta was planned against and a packed form only
+    from the start of the file.
+*/
+void attach_file(DOWNLOAD& dl, CACHED_FILE *file) {
+    dl.file = file;
+    dl.fd = file != NULL ? file->fd : -1;
+    dl.size = file != NULL ? file->size : 0;
+    dl.ready = true;
+    if (dl.delta && (file == NULL || (uint64_t)dl.size != dl.version.size)) {
+        dl.delta = false;
+        dl.chunks.clear();
+        dl.base.clear();
+    }
+    if (dl.off > dl.size || (uint64_t)dl.size != dl.version.size)
+        dl.off = 0;
+    dl.packed = !dl.delta && dl.off == 0 && file != NULL && !file->packed.empty() && dl.user->deflate_ok &&
+                dl.user->peer_frame >= PACK_BLOCK;
+}
+
+bool io_busy(USER& user) {
+    return user.recv_busy || user.send_busy || user.poll_busy;
+}
+
+void clear_rd_list(USER& user) {
+    user.rd_list = queue<string>();
+    user.rd_names.clear();
+}
+
+/*
+    A name is queued at most once, the download sends whatever version is
+    current when it starts, so later updates of a queued name are free.
+    rd_list holds at most PENDING_MAX names. A user that falls further
+    behind drops the list and sets overflow, once its downloads are done
+    queue_missing() compares the folder with held again, so nothing is
+    lost.
+*/
+void queue_download(USER& user, const char *name) {
+    if (user.overflow || user.rd_names.count(name))
+        return;
+    if (user.rd_list.size() >= PENDING_MAX) {
+        clear_rd_list(user);
+        user.overflow = true;
+        return;
+    }
+    user.rd_list.push(name);
+    user.rd_names.insert(name);
+}
+
+/*
+    Called when a newer version of name is published. A download of it that
+    sent nothing yet is dropped, one that did is marked stale and aborted
+    with a mode 14 frame by its next step.
+*/
+void supersede_download(SERVER& server, USER& user, const char *name) {
+    for (int i = 0; i < user.downloads.size(); i++) {
+        DOWNLOAD *dl = user.downloads[i];
+        if (strcmp(dl->name, name) || dl->stale)
+            continue;
+        user.stats.superseded++;
+        if (dl->announced)
+            dl->stale = true;
+        else {
+            user.downloads.erase(user.downloads.begin() + i--);
+            close_download(server, dl);
+        }
+    }
+}
+
+/*
+    Only queues what the client is missing or holds a different copy of, a
+    file still being uploaded is sent once it completes.
+*/
+void queue_missing(USER& user) {
+    user.overflow = false;
+    unordered_map<string, FILE_STATE>::iterator file = user.folder->files.begin();
+    for (; file != user.folder->files.end(); file++) {
+        unordered_map<string, MANIFEST_ENTRY>::iterator entry = user.held.find(file->first);
+        if (entry != user.held.end() && entry->second.size == file->second.size && entry->second.hash == file->second.hash)
+            continue;
+        if (user.rd_list.size() >= PENDING_MAX) {
+            user.overflow = true;
+            return;
+        }
+        queue_download(user, file->second.name);
+    }
+}
+
+/*
+    If the ring still uses the buffers of the user, shutdown() makes those
+    operations complete and complete_io() closes the fd and frees the user
+    once the last one is back.
+*/
+void user_exit(SERVER& server, USER& user) {
+    conn_stats_add(server.stats.gone, user.stats);
+    server.stats.exited++;
+    if (io_busy(user))
+        shutdown(user.fd, SHUT_RDWR);
+    else {
+        if (server.loop.backend != LOOP_URING)
+            loop_del(server.loop, user.fd);
+        server.users[user.fd] = NULL;
+        close(user.fd);
+    }
+    user.fd = -1;
+
+    unordered_map<int, UPLOAD *>::iterator it = user.uploads.begin();
+    for (; it != user.uploads.end(); it++)
+        close_upload(server, it->second);
+    user.uploads.clear();
+    user.replies = queue<UPLOAD *>();
+    user.rejects = queue<pair<int, string>>();
+    user.rejected.clear();
+
+    for (int i = 0; i < user.downloads.size(); i++)
+        close_download(server, user.downloads[i]);
+    user.downloads.clear();
+    user.seg = NULL;
+
+    if (user.folder != NULL)
+        leave_folder(user);
+    clear_rd_list(user);
+}
+
+void mark_active(SERVER& server, USER *user) {
+    if (user->active || user->fd == -1)
+        return;
+    user->active = true;
+    server.active.push_back(user);
+}
+
+bool ready_download(USER& user) {
+    for (int i = 0; i < user.downloads.size(); i++)
+        if (user.downloads[i]->ready)
+            return true;
+    return false;
+}
+
+bool has_outbound(USER& user) {
+    if (!user.replies.empty() || !user.rejects.empty() || buf_size(user.out) > 0 || ready_download(user))
+        return true;
+    if (user.overflow && user.downloads.empty())
+        return true;
+    return !user.rd_list.empty() && user.downloads.size() < MAX_DOWNLOADS;
+}
+
+/*
+    Sets the weight and the buckets of a new folder from the -l table.
+*/
+void limit_folder(SERVER& server, FOLDER& folder) {
+    if (server.limits == NULL)
+        return;
+    unordered_map<string, USER_LIMIT>::iterator it = server.limits->find(folder.name);
+    if (it == server.limits->end())
+        it = server.limits->find("*");
+    if (it == server.limits->end())
+        return;
+
+    uint64_t now = now_us();
+    folder.weight = it->second.weight;
+    bucket_init(folder.up, it->second.up_rate, now);
+    bucket_init(folder.down, it->second.down_rate, now);
+}
+
+bool recv_open(USER& user) {
+    return user.folder == NULL || bucket_open(user.folder->up, now_us());
+}
+
+bool send_open(USER& user) {
+    return user.folder == NULL || bucket_open(user.folder->down, now_us());
+}
+
+/*
+    What may go out now. Frames already in out and upload replies are not
+    held back by the download bucket, new download data is, and so is a
+    reply while a segment body is half sent.
+*/
+bool can_send(USER& user) {
+    if (buf_size(user.out) > 0)
+        return true;
+    if (send_open(user))
+        return has_outbound(user);
+    return user.seg == NULL && !user.replies.empty();
+}
+
+bool has_work(USER& user) {
+    if (user.fd == -1)
+        return false;
+    if (user.evict || user.disk_error || (user.cur_case.mode != -1 && !user.disk_wait))
+        return true;
+    if (user.can_read && buf_space(user.in) > 0 && recv_open(user))
+        return true;
+    return user.can_write && can_send(user);
+}
+
+/*
+    Parks the folder until the first of its empty buckets has a token
+    again, its sessions are woken then by wake_throttled().
+*/
+void throttle_folder(SERVER& server, FOLDER& folder) {
+    uint64_t up = bucket_delay(folder.up), down = bucket_delay(folder.down);
+    uint64_t delay = up == 0 ? down : down == 0 ? up : min(up, down);
+    uint64_t at = now_us() + delay;
+    if (at < server.next_refill)
+        server.next_refill = at;
+    if (!folder.throttled) {
+        folder.throttled = true;
+        server.throttled.push_back(&folder);
+        server.stats.throttled++;
+    }
+}
+
+/*
+    Wakes every session of the throttled folders, the ones still short of
+    tokens are parked again by update_interest().
+*/
+void wake_throttled(SERVER& server) {
+    vector<FOLDER *> folders;
+    folders.swap(server.throttled);
+    server.next_refill = UINT64_MAX;
     for (int i = 0; i < folders.size(); i++) {
-        if (!strcmp(folder_name, folders[i].name)) {
-            folder_id = i;
+        folders[i]->throttled = false;
+        for (int j = 0; j < folders[i]->sessions.size(); j++)
+            mark_active(server, folders[i]->sessions[j]);
+    }
+}
+
+/*
+    Charges what the user moved since the last call to its vtime and to
+    the buckets of its folder.
+*/
+void charge_user(USER& user) {
+    uint64_t in = user.stats.bytes_in - user.charged_in, out = user.stats.bytes_out - user.charged_out;
+    user.charged_in = user.stats.bytes_in;
+    user.charged_out = user.stats.bytes_out;
+    user.vtime += (in + out) * WEIGHT_MAX / (user.folder != NULL ? user.folder->weight : WEIGHT_DEFAULT);
+    if (user.folder != NULL) {
+        bucket_charge(user.folder->up, in);
+        bucket_charge(user.folder->down, out);
+    }
+}
+
+bool vtime_less(USER *a, USER *b) {
+    return a->vtime < b->vtime;
+}
+
+/*
+    Orders a pass lowest vtime first, users that were idle are lifted to
+    vclock first.
+*/
+void order_batch(SERVER& server, vector<USER *>& batch) {
+    for (int i = 0; i < batch.size(); i++) {
+        if (batch[i]->vtime < server.vclock)
+            batch[i]->vtime = server.vclock;
+    }
+    sort(batch.begin(), batch.end(), vtime_less);
+    if (!batch.empty())
+        server.vclock = batch[0]->vtime;
+}
+
+/*
+    Queues a read into the free space of in, a write of what is in out, or
+    a writability poll when sendfile() got EAGAIN.
+*/
+void arm_io(SERVER& server, USER& user) {
+    if (!user.recv_busy && !user.eof && buf_space(user.in) > 0 && recv_open(user)) {
+        int cnt = buf_free_iov(user.in, user.rd_iov);
+        if (loop_recv(server.loop, user.fd, user.rd_iov, cnt) == -1)
+            log_info(true, "[ERROR] loop_recv() error.\n");
+        user.recv_busy = true;
+    }
+
+    if (!user.send_busy && buf_size(user.out) > 0) {
+        memset(&user.wr_msg, 0, sizeof(user.wr_msg));
+        user.wr_msg.msg_iov = user.wr_iov;
+        user.wr_msg.msg_iovlen = buf_data_iov(user.out, user.wr_iov);
+        if (loop_send(server.loop, user.fd, &user.wr_msg) == -1)
+            log_info(true, "[ERROR] loop_send() error.\n");
+        user.send_busy = true;
+        user.can_write = false;
+    } else if (!user.poll_busy && !user.send_busy && !user.can_write && can_send(user)) {
+        if (loop_poll_out(server.loop, user.fd) == -1)
+            log_info(true, "[ERROR] loop_poll_out() error.\n");
+        user.poll_busy = true;
+    }
+}
+
+/*
+    Reads are only watched while in has room, so a user whose frames wait
+    on the disk queue is left to the TCP window instead of waking select()
+    on every pass. The same goes for a folder out of tokens, it is parked
+    until the refill. The stall clock of the user runs while it has
+    something to send but has to wait for the socket.
+*/
+void update_interest(SERVER& server, USER& user) {
+    if (user.fd == -1)
+        return;
+    bool room = !user.eof && buf_space(user.in) > 0;
+    bool rd = room && recv_open(user), wr = can_send(user);
+    if ((room && !rd) || (!wr && has_outbound(user) && !send_open(user)))
+        throttle_folder(server, *user.folder);
+    if (server.loop.backend == LOOP_URING)
+        arm_io(server, user);
+    else if (user.rd_interest != rd || user.wr_interest != wr) {
+        user.rd_interest = rd;
+        user.wr_interest = wr;
+        if (!wr)
+            user.can_write = false;
+        if (loop_mod(server.loop, user.fd, (rd ? EV_READ : 0) | (wr ? EV_WRITE : 0)) == -1)
+            log_info(true, "[ERROR] loop_mod() error.\n");
+    }
+
+    if (user.can_write || !wr)
+        user.stall_since = 0;
+    else if (user.stall_since == 0)
+        user.stall_since = now_us();
+}
+
+/*
+    Output is batched in the ring and coalesced with MSG_MORE and TCP_CORK,
+    so Nagle would only delay the small replies clients wait on. Fixed
+    socket buffers are only set with -b, otherwise the kernel autotunes
+    them.
+*/
+void tune_socket(SERVER& server, int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (server.sock_buf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &server.sock_buf, sizeof(server.sock_buf));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &server.sock_buf, sizeof(server.sock_buf));
+    }
+}
+
+void set_cork(USER& user, bool on) {
+    int flag = on;
+    if (user.corked != on && setsockopt(user.fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag)) == 0)
+        user.corked = on;
+}
+
+void accept_clients(SERVER& server) {
+    while (true) {
+        int client_fd = accept(server.fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EAGAIN)
+                log_trace("[INFO] accept() not finished.\n");
+            else if (errno == EMFILE || errno == ENFILE)
+                log_info(false, "[INFO] accept() out of fds.\n");
+            else
+                log_info(true, "[ERROR] accept() error.\n");
+            return;
+        }
+
+        set_no_blocking(client_fd);
+        tune_socket(server, client_fd);
+        if (server.loop.backend != LOOP_URING && loop_add(server.loop, client_fd, EV_READ) == -1) {
+            log_info(false, "[INFO] loop_add() rejected client.\n");
+            close(client_fd);
+            continue;
+        }
+        log_trace("[INFO] accept() new client.\n");
+        server.stats.accepted++;
+
+        USER *client = new USER();
+        client->fd = client_fd;
+        if ((int)server.users.size() <= client_fd)
+            server.users.resize(client_fd + 1, NULL);
+        server.users[client_fd] = client;
+        if (server.loop.backend == LOOP_URING) {
+            client->can_write = true;
+            mark_active(server, client);
+        }
+    }
+}
+
+bool valid_name(PACKAGE& pkg) {
+    if (pkg.len == 0 || pkg.len >= NAME_SIZE || strlen(pkg.buf) != pkg.len)
+        return false;
+    return strchr(pkg.buf, '/') == NULL && pkg.buf[0] != '.';
+}
+
+void drop_user(SERVER& server, USER& user, const char *msg) {
+    log_info(false, msg);
+    user_exit(server, user);
+}
+
+/*
+    Queues the open of the .part file, of the old copy and of the resume
+    file left by an interrupted upload of the name. The old copy is only
+    used when no rename of it is in flight, otherwise the worker could open
+    a newer version than base_chunks describes.
+*/
+UPLOAD *begin_upload(SERVER& server, USER& user, int id, char *name) {
+    UPLOAD *up = new UPLOAD();
+    up->id = id;
+    up->user = &user;
+    up->folder = user.folder;
+    strcpy(up->name, name);
+    sprintf(up->tmp_path, "%s/.%s.%llu.part", user.name, up->name, (unsigned long long)user.folder->next_version++);
+
+    FILE_JOB *job = new_job(server, JOB_OPEN_UPLOAD);
+    job->up = up;
+    unordered_map<string, FILE_STATE>::iterator it = user.folder->files.find(up->name);
+    if (it != user.folder->files.end() && !it->second.chunks.empty() && !user.folder->publishing.count(up->name)) {
+        up->base_chunks = it->second.chunks;
+        sprintf(job->path, "%s/%s", user.name, up->name);
+    }
+    unordered_map<string, RESUME_FILE>::iterator resume = user.folder->resume.find(up->name);
+    if (resume != user.folder->resume.end()) {
+        strcpy(up->resume_path, resume->second.path);
+        strcpy(job->resume_path, up->resume_path);
+        up->resume_chunks.swap(resume->second.chunks);
+        user.folder->resume.erase(resume);
+    }
+    up->wr_size = 0;
+    up->wr_off = 0;
+    up->wr_hash = HASH_INIT;
+    up->start = now_us();
+    submit_job(server, *up->folder, job);
+    return up;
+}
+
+void add_signatures(UPLOAD& up, PACKAGE& pkg) {
+    for (int i = 0; i < pkg.len; i += SIG_SIZE) {
+        CHUNK chunk;
+        sig_get(pkg.buf + i, chunk);
+        up.sigs.push_back(chunk);
+    }
+}
+
+/*
+    Appends a span to the batch of the upload, the batch goes to the disk
+    pool once it holds DISK_BATCH bytes or the upload ends. data is only
+    read for SPAN_DATA, the copies take off, len and crc from chunk.
+*/
+void add_span(SERVER& server, UPLOAD& up, int src, CHUNK& chunk, const char *data) {
+    if (up.batch == NULL) {
+        up.batch = new_job(server, JOB_WRITE);
+        up.batch->up = &up;
+    }
+
+    FILE_JOB& job = *up.batch;
+    if (src == SPAN_DATA && !job.spans.empty() && job.spans.back().src == SPAN_DATA)
+        job.spans.back().len += chunk.len;
+    else {
+        SPAN span;
+        span.src = src;
+        span.off = chunk.off;
+        span.len = chunk.len;
+        span.crc = chunk.crc;
+        job.spans.push_back(span);
+    }
+    if (src == SPAN_DATA) {
+        job.data.append(data, chunk.len);
+        up.user->disk_queued += chunk.len;
+    }
+    job.len += chunk.len;
+    up.wr_size += chunk.len;
+}
+
+void submit_batch(SERVER& server, UPLOAD& up) {
+    up.batch->bytes = up.batch->data.size();
+    submit_job(server, *up.folder, up.batch);
+    up.batch = NULL;
+}
+
+/*
+    Queues a copy of the chunks starting at up.idx that the old copy or the
+    resume file already has, up to the next one the client has to send.
+*/
+void copy_chunks(SERVER& server, UPLOAD& up) {
+    while (up.idx < up.sigs.size() && !up.need[up.idx]) {
+        add_span(server, up, up.resumed[up.idx] ? SPAN_RESUME : SPAN_BASE, up.sigs[up.idx], NULL);
+        up.idx++;
+    }
+    up.crc = 0;
+    if (up.idx < up.sigs.size())
+        up.left = up.sigs[up.idx].len;
+    if (up.batch != NULL && up.batch->len >= DISK_BATCH)
+        submit_batch(server, up);
+}
+
+CHUNK *same_chunk(unordered_map<uint64_t, CHUNK>& chunks, CHUNK& sig) {
+    unordered_map<uint64_t, CHUNK>::iterator it = chunks.find(sig.hash);
+    if (it == chunks.end() || it->second.len != sig.len || it->second.crc != sig.crc)
+        return NULL;
+    return &it->second;
+}
+
+/*
+    Decides which chunks have to be sent by looking them up in the chunk
+    list of the current copy and then of the resume file. For chunks that
+    can be reused, sig.off is rewritten to where they sit in that file.
+*/
+void plan_upload(SERVER& server, USER& user, UPLOAD& up) {
+    unordered_map<uint64_t, CHUNK> base, resume;
+    for (int i = 0; i < up.base_chunks.size(); i++)
+        base[up.base_chunks[i].hash] = up.base_chunks[i];
+    for (int i = 0; i < up.resume_chunks.size(); i++)
+        resume[up.resume_chunks[i].hash] = up.resume_chunks[i];
+    up.base_chunks.clear();
+
+    up.need.assign(up.sigs.size(), true);
+    up.resumed.assign(up.sigs.size(), false);
+    up.need_list.clear();
+    for (int i = 0; i < up.sigs.size(); i++) {
+        CHUNK& sig = up.sigs[i];
+        CHUNK *known = same_chunk(base, sig);
+        if (known == NULL && (known = same_chunk(resume, sig)) != NULL)
+            up.resumed[i] = true;
+        if (known != NULL) {
+            up.need[i] = false;
+            sig.off = known->off;
+        } else
+            up.need_list.push_back(i);
+    }
+
+    up.sig_done = true;
+    up.need_sent = 0;
+    up.idx = 0;
+    user.replies.push(&up);
+    copy_chunks(server, up);
+}
+
+/*
+    Returns 1 on success, 0 for a chunk whose crc does not match its
+    signature and -1 for data past the last chunk.
+*/
+int write_upload(SERVER& server, UPLOAD& up, const char *data, uint32_t len) {
+    while (len > 0) {
+        if (up.idx == up.sigs.size())
+            return -1;
+
+        CHUNK piece;
+        piece.off = 0;
+        piece.crc = 0;
+        piece.len = len < up.left ? len : up.left;
+        add_span(server, up, SPAN_DATA, piece, data);
+        up.crc = crc32c_update(up.crc, data, piece.len);
+        data += piece.len;
+        len -= piece.len;
+        up.left -= piece.len;
+        if (up.left == 0) {
+            if (up.crc != up.sigs[up.idx].crc)
+                return 0;
+            up.idx++;
+            copy_chunks(server, up);
+        }
+    }
+    if (up.batch != NULL && up.batch->len >= DISK_BATCH)
+        submit_batch(server, up);
+    return 1;
+}
+
+/*
+    Inflates a mode 18 frame into the chunk at up.idx. The stream has to
+    start at the beginning of a chunk and end with its last byte, output
+    past that fails instead of spilling into the next chunk. Returns 1 on
+    success, 0 for a stream that does not inflate to the chunk and -1 for
+    one that does not start at a chunk or data past the last chunk.
+*/
+int inflate_upload(SERVER& server, UPLOAD& up, const char *data, uint32_t len) {
+    char out[FRAME_MAX];
+    if (!up.z_busy && (up.idx == up.sigs.size() || up.left != up.sigs[up.idx].len))
+        return -1;
+    if (up.zin == NULL) {
+        up.zin = new z_stream();
+        memset(up.zin, 0, sizeof(z_stream));
+        if (inflateInit(up.zin) != Z_OK) {
+            delete up.zin;
+            up.zin = NULL;
+            return 0;
+        }
+    }
+    if (!up.z_busy) {
+        up.z_busy = true;
+        up.z_left = up.left;
+    }
+
+    z_stream& z = *up.zin;
+    z.next_in = (Bytef *)data;
+    z.avail_in = len;
+    while (true) {
+        z.next_out = (Bytef *)out;
+        z.avail_out = sizeof(out);
+        int res = inflate(&z, Z_NO_FLUSH);
+        uint32_t got = sizeof(out) - z.avail_out;
+        if ((res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) || got > up.z_left)
+            return 0;
+        up.z_left -= got;
+        int wrote = got > 0 ? write_upload(server, up, out, got) : 1;
+        if (wrote != 1)
+            return wrote;
+        if (res == Z_STREAM_END) {
+            up.z_busy = false;
+            inflateReset(&z);
+            return up.z_left == 0 && z.avail_in == 0 ? 1 : 0;
+        }
+        if (z.avail_in == 0 && z.avail_out > 0)
+            return 1;
+        if (res == Z_BUF_ERROR)
+            return 0;
+    }
+}
+
+/*
+    Drops an upload whose data failed its checks while the session goes
+    on. The upload stays in user.uploads, closed to new frames, until
+    stop_upload() is back, the client is told with a mode 20 frame.
+*/
+void reject_upload(SERVER& server, USER& user, UPLOAD *up) {
+    log_info(false, "[INFO] upload failed its checks. upload rejected.\n");
+    stop_upload(server, up);
+    user.rejects.push(make_pair(up->id, string(up->name)));
+    user.rejected.insert(up->id);
+}
+
+/*
+    Queues the last writes, the close and the rename of the .part file. The
+    upload stays in user.uploads, closed to new frames, until the rename is
+    back.
+*/
+void finish_upload(SERVER& server, USER& user, UPLOAD *up) {
+    if (up->batch == NULL) {
+        up->batch = new_job(server, JOB_WRITE);
+        up->batch->up = up;
+    }
+    FILE_JOB *job = up->batch;
+    job->op = JOB_PUBLISH;
+    sprintf(job->path, "%s/%s", user.name, up->name);
+    strcpy(job->resume_path, up->resume_path);
+    for (int i = 0; i < user.folder->sessions.size(); i++)
+        job->pack |= user.folder->sessions[i] != &user && user.folder->sessions[i]->deflate_ok;
+    up->closing = true;
+    user.folder->publishing[up->name]++;
+    submit_batch(server, *up);
+}
+
+/*
+    Publishes the renamed file, caches the fd the worker opened after the
+    rename and queues it for every other session of the folder. When two
+    uploads of the same name overlap the one whose rename runs last wins.
+
+    A failed rename leaves the published version as it was. Once no other
+    rename of the name is in flight, the sessions that skipped it in
+    start_downloads() meanwhile get it queued again, unless they already
+    hold that version.
+*/
+void publish_upload(SERVER& server, FILE_JOB& job) {
+    UPLOAD *up = job.up;
+    USER *user = up->user;
+    FOLDER& folder = *up->folder;
+    if (--folder.publishing[up->name] == 0)
+        folder.publishing.erase(up->name);
+    if (user != NULL)
+        user->uploads.erase(up->id);
+    if (job.res == -1) {
+        if (user != NULL)
+            user->disk_error = true;
+        unordered_map<string, FILE_STATE>::iterator it = folder.files.find(up->name);
+        for (int j = 0; it != folder.files.end() && !folder.publishing.count(up->name) && j < folder.sessions.size(); j++) {
+            USER *peer = folder.sessions[j];
+            unordered_map<string, MANIFEST_ENTRY>::iterator held = peer->held.find(up->name);
+            if (peer == user || (held != peer->held.end() && held->second.size == it->second.size && held->second.hash == it->second.hash))
+                continue;
+            queue_download(*peer, up->name);
+            update_interest(server, *peer);
+            mark_active(server, peer);
+        }
+        delete up;
+        return;
+    }
+
+    unordered_map<string, FILE_STATE>::iterator it = folder.files.find(up->name);
+    if (it == folder.files.end())
+        it = folder.files.insert(make_pair(string(up->name), FILE_STATE(up->name))).first;
+    FILE_STATE& state = it->second;
+    state.prev_size = state.size;
+    state.prev_hash = state.hash;
+    state.prev_chunks.swap(state.chunks);
+    state.size = up->wr_size;
+    state.hash = up->wr_hash;
+    state.chunks.swap(up->sigs);
+    uint64_t off = 0;
+    for (int i = 0; i < state.chunks.size(); i++) {
+        state.chunks[i].off = off;
+        off += state.chunks[i].len;
+    }
+
+    MANIFEST_ENTRY version;
+    version.size = state.size;
+    version.hash = state.hash;
+    if (user != NULL) {
+        user->held[up->name] = version;
+        user->stats.uploads++;
+    }
+    hist_add(server.stats.upload_us, now_us() - up->start);
+    if (job.fd != -1) {
+        CACHED_FILE *file = cache_add(server, folder, up->name, version, job.fd, state.size);
+        if (job.pack)
+            cache_pack(server, file, job.data);
+        cache_put(server, file);
+    }
+
+    vector<USER *>& sessions = folder.sessions;
+    for (int j = 0; j < sessions.size(); j++) {
+        USER *peer = sessions[j];
+        if (peer == user)
+            continue;
+        supersede_download(server, *peer, up->name);
+        queue_download(*peer, up->name);
+        update_interest(server, *peer);
+        mark_active(server, peer);
+    }
+    delete up;
+}
+
+/*
+    Applies a finished disk job. Failures are left to serve_user() through
+    disk_error since the user may not be in the active batch.
+*/
+void complete_job(SERVER& server, FILE_JOB *job) {
+    hist_add(server.stats.disk_us, now_us() - job->start);
+    UPLOAD *up = job->up;
+    DOWNLOAD *dl = job->dl;
+    USER *user = up != NULL ? up->user : NULL;
+
+    if (user != NULL) {
+        user->disk_queued -= job->bytes;
+        if (user->disk_wait && user->disk_queued < DISK_QUEUE)
+            user->disk_wait = false;
+        mark_active(server, user);
+    }
+
+    if (job->op == JOB_OPEN_UPLOAD || job->op == JOB_WRITE) {
+        if (user != NULL && job->res == -1)
+            user->disk_error = true;
+    } else if (job->op == JOB_PUBLISH) {
+        publish_upload(server, *job);
+    } else if (job->op == JOB_DISCARD) {
+        if (user != NULL)
+            user->uploads.erase(up->id);
+        delete up;
+    } else if (job->op == JOB_SUSPEND) {
+        if (user != NULL)
+            user->uploads.erase(up->id);
+        unordered_map<string, RESUME_FILE>::iterator it = up->folder->resume.find(up->name);
+        if (job->res == -1 && it != up->folder->resume.end() && !strcmp(it->second.path, up->tmp_path))
+            up->folder->resume.erase(it);
+        delete up;
+    } else if (job->op == JOB_OPEN_DOWNLOAD) {
+        if (dl->user == NULL) {
+            if (job->res != -1)
+                close(job->res);
+            delete dl;
+        } else {
+            CACHED_FILE *file = NULL;
+            if (job->res != -1) {
+                FOLDER& folder = *dl->user->folder;
+                file = cache_get(server, folder, dl->name, dl->version);
+                if (file != NULL)
+                    close(job->res);
+                else
+                    file = cache_add(server, folder, dl->name, dl->version, job->res, job->size);
+                if (job->pack)
+                    cache_pack(server, file, job->data);
+            }
+            attach_file(*dl, file);
+            update_interest(server, *dl->user);
+            mark_active(server, dl->user);
+        }
+    }
+    delete job;
+}
+
+void drain_disk(SERVER& server) {
+    DISK_JOB *list = disk_drain(server.disk_done);
+    while (list != NULL) {
+        DISK_JOB *next = list->next;
+        complete_job(server, (FILE_JOB *)list->ctx);
+        list = next;
+    }
+}
+
+/*
+    Handles user.cur_case, the user may have been dropped on return. Data
+    for an upload is left in cur_case with disk_wait set while the user's
+    disk queue is full.
+*/
+void handle_case(SERVER& server, USER& user) {
+    if (user.cur_case.mode == 0) {
+        if (!valid_name(user.cur_case) || user.folder != NULL) {
+            drop_user(server, user, "[INFO] recv mode 0 error. bad username.\n");
+            return;
+        }
+        strcpy(user.name, user.cur_case.buf);
+
+        unordered_map<string, FOLDER>::iterator it = server.folders.find(user.name);
+        if (it == server.folders.end()) {
+            it = server.folders.insert(make_pair(string(user.name), FOLDER(user.name))).first;
+            limit_folder(server, it->second);
+            FILE_JOB *job = new_job(server, JOB_MKDIR);
+            strcpy(job->path, user.name);
+            submit_job(server, it->second, job);
+        }
+        join_folder(&it->second, user);
+        user.syncing = true;
+    } else if (user.cur_case.mode == 4) {
+        if (!user.syncing || user.cur_case.len <= 16) {
+            drop_user(server, user, "[INFO] recv mode 4 error. unexpected manifest.\n");
+            return;
+        }
+
+        MANIFEST_ENTRY entry;
+        entry.size = get_u64(user.cur_case.buf);
+        entry.hash = get_u64(user.cur_case.buf + 8);
+        user.held[user.cur_case.buf + 16] = entry;
+    } else if (user.cur_case.mode == 5) {
+        if (!user.syncing) {
+            drop_user(server, user, "[INFO] recv mode 5 error. unexpected manifest.\n");
+            return;
+        }
+        queue_missing(user);
+        user.syncing = false;
+    } else if (user.cur_case.mode == 17) {
+        const char *name = user.cur_case.buf + 24;
+        if (!user.syncing || user.cur_case.len <= 24 || user.cur_case.len - 24 >= NAME_SIZE || strlen(name) != user.cur_case.len - 24) {
+            drop_user(server, user, "[INFO] recv mode 17 error. unexpected partial copy.\n");
+            return;
+        }
+
+        PARTIAL_COPY copy;
+        copy.version.size = get_u64(user.cur_case.buf);
+        copy.version.hash = get_u64(user.cur_case.buf + 8);
+        copy.off = get_u64(user.cur_case.buf + 16);
+        if (copy.off < copy.version.size)
+            user.partial[name] = copy;
+    } else if (user.cur_case.mode == 21) {
+        const char *name = user.cur_case.buf;
+        if (user.syncing || user.cur_case.len == 0 || user.cur_case.len >= NAME_SIZE || strlen(name) != user.cur_case.len) {
+            drop_user(server, user, "[INFO] recv mode 21 error. unexpected download request.\n");
+            return;
+        }
+
+        /* without a held copy or a partial one the download is sent in full */
+        user.held.erase(name);
+        user.partial.erase(name);
+        if (user.folder->files.count(name))
+            queue_download(user, name);
+    } else if (user.cur_case.mode == 15) {
+        if (user.cur_case.len != 4 && user.cur_case.len != 8) {
+            drop_user(server, user, "[INFO] recv mode 15 error. bad frame limit.\n");
+            return;
+        }
+        user.peer_frame = limit_get(user.cur_case);
+        user.resume_ok = limit_flags(user.cur_case) & FEATURE_RESUME;
+        user.deflate_ok = limit_flags(user.cur_case) & FEATURE_DEFLATE;
+        limit_push(user.out, FEATURE_RESUME | FEATURE_DEFLATE);
+    } else if (user.cur_case.mode == 1) {
+        if (!valid_name(user.cur_case) || user.cur_case.stream % 2 == 0 || user.uploads.count(user.cur_case.stream)) {
+            drop_user(server, user, "[INFO] recv mode 1 error. bad filename or stream.\n");
+            return;
+        }
+        if (user.folder == NULL) {
+            drop_user(server, user, "[INFO] recv mode 1 error. no such folder.\n");
+            return;
+        }
+
+        UPLOAD *up = begin_upload(server, user, user.cur_case.stream, user.cur_case.buf);
+        user.uploads[up->id] = up;
+    } else if (user.cur_case.mode == 20) {
+        unordered_map<int, UPLOAD *>::iterator it = user.uploads.find(user.cur_case.stream);
+        if (user.rejected.erase(user.cur_case.stream) == 0) {
+            if (it == user.uploads.end() || !it->second->replied || it->second->closing || user.cur_case.len != 0) {
+                drop_user(server, user, "[INFO] recv mode 20 error. no such upload.\n");
+                return;
+            }
+            stop_upload(server, it->second);
+        }
+    } else if (user.rejected.count(user.cur_case.stream) && (user.cur_case.mode == 2 || user.cur_case.mode == 18)) {
+        if (user.cur_case.mode == 2 && user.cur_case.len == 0)
+            user.rejected.erase(user.cur_case.stream);
+    } else if (user.cur_case.mode == 7 || user.cur_case.mode == 8 || user.cur_case.mode == 2 || user.cur_case.mode == 18) {
+        unordered_map<int, UPLOAD *>::iterator it = user.uploads.find(user.cur_case.stream);
+        UPLOAD *up = it == user.uploads.end() || it->second->closing ? NULL : it->second;
+
+        if (user.cur_case.mode == 7) {
+            if (up == NULL || up->sig_done || user.cur_case.len % SIG_SIZE != 0) {
+                drop_user(server, user, "[INFO] recv mode 7 error. unexpected signatures.\n");
+                return;
+            }
+            add_signatures(*up, user.cur_case);
+        } else if (user.cur_case.mode == 8) {
+            if (up == NULL || up->sig_done) {
+                drop_user(server, user, "[INFO] recv mode 8 error. unexpected signatures.\n");
+                return;
+            }
+            plan_upload(server, user, *up);
+        } else if (up == NULL || !up->replied) {
+            drop_user(server, user, "[INFO] recv mode 2 error. no such upload.\n");
+            return;
+        } else if (user.cur_case.mode == 18) {
+            if (!user.deflate_ok || user.cur_case.len == 0) {
+                drop_user(server, user, "[INFO] recv mode 18 error. unexpected deflated data.\n");
+                return;
+            }
+            if (user.disk_queued >= DISK_QUEUE) {
+                user.disk_wait = true;
+                return;
+            }
+            int res = inflate_upload(server, *up, user.cur_case.buf, user.cur_case.len);
+            if (res == -1) {
+                drop_user(server, user, "[INFO] recv mode 18 error. data past the chunks.\n");
+                return;
+            }
+            if (res == 0)
+                reject_upload(server, user, up);
+        } else if (up->z_busy) {
+            drop_user(server, user, "[INFO] recv mode 2 error. chunk is deflated.\n");
+            return;
+        } else if (user.cur_case.len == 0) {
+            if (up->idx != up->sigs.size()) {
+                drop_user(server, user, "[INFO] recv mode 2 error. missing chunks.\n");
+                return;
+            }
+            finish_upload(server, user, up);
+        } else if (user.disk_queued >= DISK_QUEUE) {
+            user.disk_wait = true;
+            return;
+        } else {
+            int res = write_upload(server, *up, user.cur_case.buf, user.cur_case.len);
+            if (res == -1) {
+                drop_user(server, user, "[INFO] recv mode 2 error. data past the chunks.\n");
+                return;
+            }
+            if (res == 0)
+                reject_upload(server, user, up);
+        }
+    } else {
+        drop_user(server, user, "[INFO] recv error. unknown mode.\n");
+        return;
+    }
+
+    user.cur_case.mode = -1;
+}
+
+void recv_user(SERVER& server, USER& user) {
+    while (buf_space(user.in) > 0) {
+        int len = buf_recv(user.in, user.fd);
+        if (len == -1) {
+            if (errno == EAGAIN) {
+                user.can_read = false;
+                user.stats.recv_eagain++;
+                log_trace("[INFO] recv() not finished.\n");
+            } else
+                drop_user(server, user, "[INFO] recv() error. drop client.\n");
+            return;
+        } else if (len == 0) {
+            user.can_read = false;
+            user.eof = true;
+            return;
+        }
+        user.stats.bytes_in += len;
+    }
+}
+
+bool flush_output(SERVER& server, USER& user) {
+    if (server.loop.backend == LOOP_URING)
+        return buf_size(user.out) == 0;
+
+    while (buf_size(user.out) > 0) {
+        int len = buf_send(user.out, user.fd, user.seg != NULL ? MSG_MORE : 0);
+        if (len == -1) {
+            if (errno == EAGAIN) {
+                user.can_write = false;
+                user.stats.send_eagain++;
+                log_trace("[INFO] send() not finished.\n");
+            } else
+                drop_user(server, user, "[INFO] send() error. drop client.\n");
+            return false;
+        }
+        user.stats.bytes_out += len;
+        user.stall_since = 0;
+    }
+    return true;
+}
+
+void finish_download(SERVER& server, USER& user, int pos) {
+    DOWNLOAD *dl = user.downloads[pos];
+    user.held[dl->name] = dl->version;
+    user.stats.downloads++;
+    hist_add(server.stats.download_us, now_us() - dl->start);
+    user.downloads.erase(user.downloads.begin() + pos);
+    close_download(server, dl);
+}
+
+/*
+    Sends the body of the current segment straight from the page cache with
+    sendfile(). Returns false if the socket is full or the user was dropped.
+*/
+bool stream_segment(SERVER& server, USER& user, off_t& budget) {
+    DOWNLOAD *dl = user.seg;
+    set_cork(user, true);
+    while (user.seg_left > 0 && budget > 0) {
+        ssize_t len = sendfile(user.fd, dl->fd, &dl->off, user.seg_left < budget ? user.seg_left : budget);
+        if (len == -1) {
+            if (errno == EAGAIN) {
+                user.can_write = false;
+                user.stats.send_eagain++;
+                log_trace("[INFO] sendfile() not finished.\n");
+            } else
+                drop_user(server, user, "[INFO] sendfile() error. drop client.\n");
+            return false;
+        } else if (len == 0) {
+            drop_user(server, user, "[INFO] sendfile() file shrank. drop client.\n");
+            return false;
+        }
+        user.seg_left -= len;
+        user.stats.bytes_out += len;
+        user.stall_since = 0;
+        budget -= len;
+    }
+    if (user.seg_left == 0)
+        user.seg = NULL;
+    return true;
+}
+
+/*
+    Copies the records of the packed form into out as they are, until out
+    is full or one segment worth of frames is queued.
+*/
+void packed_output(USER& user, DOWNLOAD& dl, off_t& budget) {
+    const string& packed = dl.file->packed;
+    uint32_t queued = 0;
+
+    while (dl.pack_pos < packed.size() && queued < SEGMENT_SIZE) {
+        uint32_t head;
+        memcpy(&head, packed.data() + dl.pack_pos, 4);
+        uint32_t len = head & ~PACK_DEFLATED;
+        if (!frame_fits(user.out, len))
+            break;
+        frame_push(user.out, head & PACK_DEFLATED ? 19 : 2, dl.id, packed.data() + dl.pack_pos + 4, len);
+        queued += HEADER_SIZE + len;
+        dl.pack_pos += 4 + len;
+    }
+    budget -= queued;
+}
+
+/*
+    Turns the new chunk list into copy frames for chunks the client's old
+    copy has and data frames for the rest, until out is full or one segment
+    worth of frames is queued. Returns false if the user was dropped.
+*/
+bool delta_output(SERVER& server, USER& user, DOWNLOAD& dl, off_t& budget) {
+    char chunk[FRAME_MAX], copy[12];
+    uint32_t queued = 0, frame = frame_target(user.fd, user.peer_frame);
+
+    while (dl.idx < dl.chunks.size() && queued < SEGMENT_SIZE) {
+        CHUNK& c = dl.chunks[dl.idx];
+        unordered_map<uint64_t, CHUNK>::iterator base = dl.base.find(c.hash);
+        if (dl.chunk_off == 0 && base != dl.base.end() && base->second.len == c.len) {
+            uint32_t net_len = htonl(c.len);
+            put_u64(copy, base->second.off);
+            memcpy(copy + 8, &net_len, 4);
+            if (!frame_push(user.out, 12, dl.id, copy, 12))
+                break;
+            queued += HEADER_SIZE + 12;
+            dl.idx++;
+            continue;
+        }
+
+        uint32_t len = c.len - dl.chunk_off < frame ? c.len - dl.chunk_off : frame;
+        if (!frame_fits(user.out, len))
             break;
+        const char *src = cache_map(server, *dl.file);
+        if (src != NULL)
+            src += c.off + dl.chunk_off;
+        else if (pread(dl.fd, chunk, len, c.off + dl.chunk_off) == len)
+            src = chunk;
+        else {
+            drop_user(server, user, "[INFO] pread() error. drop client.\n");
+            return false;
+        }
+        frame_push(user.out, 2, dl.id, src, len);
+        queued += HEADER_SIZE + len;
+        dl.chunk_off += len;
+        if (dl.chunk_off == c.len) {
+            dl.idx++;
+            dl.chunk_off = 0;
         }
     }
-    if (folder_id == -1)
-        log_info(true, "[ERROR] change_file_state() error. no such folder.\n");
+    budget -= queued;
+    return true;
+}
 
-    int file_id = -1;
-    for (int i = 0; i < folders[folder_id].files.size(); i++) {
-        if (!strcmp(file_name, folders[folder_id].files[i].name)) {
-            file_id = i;
+/*
+    Queues the open of the next files in rd_list, a file whose rename is
+    still in flight is skipped since it is queued again once published. An
+    overflowed rd_list is refilled once the running downloads are done.
+    Whether to send a delta is decided from the FILE_STATE the open was
+    queued against. The file is taken from the cache if it holds that
+    version.
+*/
+void start_downloads(SERVER& server, USER& user) {
+    if (user.overflow && user.rd_list.empty() && user.downloads.empty())
+        queue_missing(user);
+
+    while (user.downloads.size() < MAX_DOWNLOADS && !user.rd_list.empty()) {
+        string file_name = user.rd_list.front();
+        user.rd_list.pop();
+        user.rd_names.erase(file_name);
+        if (user.folder->publishing.count(file_name))
+            continue;
+
+        DOWNLOAD *dl = new DOWNLOAD();
+        dl->id = user.next_stream;
+        dl->user = &user;
+        dl->start = now_us();
+        user.next_stream += 2;
+        strcpy(dl->name, file_name.c_str());
+
+        FILE_STATE& state = user.folder->files[dl->name];
+        unordered_map<string, MANIFEST_ENTRY>::iterator held = user.held.find(dl->name);
+        dl->delta = !state.prev_chunks.empty() && held != user.held.end() && held->second.hash == state.prev_hash &&
+                    held->second.size == state.prev_size;
+        dl->version.size = state.size;
+        dl->version.hash = state.hash;
+        if (dl->delta) {
+            dl->chunks = state.chunks;
+            for (int i = 0; i < state.prev_chunks.size(); i++)
+                dl->base[state.prev_chunks[i].hash] = state.prev_chunks[i];
+        }
+        unordered_map<string, PARTIAL_COPY>::iterator partial = user.partial.find(dl->name);
+        if (partial != user.partial.end()) {
+            if (!dl->delta && partial->second.version.size == state.size && partial->second.version.hash == state.hash)
+                dl->off = partial->second.off;
+            user.partial.erase(partial);
+        }
+
+        user.downloads.push_back(dl);
+        bool pack = user.deflate_ok && !dl->delta;
+        CACHED_FILE *file = cache_get(server, *user.folder, dl->name, dl->version);
+        if (file != NULL && (!pack || file->pack_tried)) {
+            server.stats.cache_hits++;
+            attach_file(*dl, file);
+            continue;
+        }
+        if (file != NULL)
+            cache_put(server, file);
+
+        server.stats.cache_misses++;
+        FILE_JOB *job = new_job(server, JOB_OPEN_DOWNLOAD);
+        job->dl = dl;
+        job->pack = pack;
+        sprintf(job->path, "%s/%s", user.name, dl->name);
+        submit_job(server, *user.folder, job);
+    }
+}
+
+/*
+    Sends the begin frame of an opened download, returns false if out is
+    full. A client that can resume gets mode 16 with the offset the body
+    starts at.
+*/
+bool announce_download(USER& user, DOWNLOAD& dl) {
+    char header[24 + NAME_SIZE];
+    int name_len = strlen(dl.name);
+    if (!frame_fits(user.out, 24 + name_len))
+        return false;
+
+    if (dl.delta) {
+        log_trace("[INFO] send delta download.\n");
+        put_u64(header, dl.version.size);
+        put_u64(header + 8, dl.version.hash);
+        memcpy(header + 16, dl.name, name_len);
+        frame_push(user.out, 11, dl.id, header, 16 + name_len);
+    } else if (user.resume_ok) {
+        if (dl.off > 0)
+            log_trace("[INFO] send resumed download.\n");
+        put_u64(header, dl.size);
+        put_u64(header + 8, dl.version.hash);
+        put_u64(header + 16, dl.off);
+        memcpy(header + 24, dl.name, name_len);
+        frame_push(user.out, 16, dl.id, header, 24 + name_len);
+    } else {
+        put_u64(header, dl.size);
+        memcpy(header + 8, dl.name, name_len);
+        frame_push(user.out, 3, dl.id, header, 8 + name_len);
+    }
+    dl.announced = true;
+    return true;
+}
+
+/*
+    Queues the next piece of download pos, a segment header for a full
+    download or a batch of delta frames, and the closing frame once the
+    whole file went out.
+*/
+bool step_download(SERVER& server, USER& user, int pos, off_t& budget) {
+    DOWNLOAD& dl = *user.downloads[pos];
+    bool done;
+    if (!dl.ready || (!dl.announced && !announce_download(user, dl)))
+        return true;
+    if (dl.stale) {
+        if (user.seg != &dl && frame_push(user.out, 14, dl.id, "", 0)) {
+            user.downloads.erase(user.downloads.begin() + pos);
+            close_download(server, &dl);
+        }
+        return true;
+    }
+    if (dl.delta) {
+        if (!delta_output(server, user, dl, budget))
+            return false;
+        done = dl.idx == dl.chunks.size();
+    } else if (dl.packed) {
+        packed_output(user, dl, budget);
+        done = dl.pack_pos == dl.file->packed.size();
+    } else if (dl.off < dl.size) {
+        if (buf_space(user.out) < HEADER_SIZE)
+            return true;
+        off_t left = dl.size - dl.off;
+        user.seg = &dl;
+        user.seg_left = left < SEGMENT_SIZE ? left : SEGMENT_SIZE;
+        header_push(user.out, 13, dl.id, user.seg_left);
+        return true;
+    } else
+        done = true;
+
+    if (done && frame_push(user.out, 2, dl.id, "", 0))
+        finish_download(server, user, pos);
+    return true;
+}
+
+/*
+    Sends the chunk list one upload is waiting for, returns false if out
+    filled up first.
+*/
+bool send_reply(USER& user, UPLOAD& up) {
+    char chunk[BUF_SIZE];
+
+    while (up.need_sent < up.need_list.size()) {
+        int cnt = 0;
+        for (; cnt < BUF_SIZE / 4 && up.need_sent + cnt < up.need_list.size(); cnt++) {
+            uint32_t net_idx = htonl(up.need_list[up.need_sent + cnt]);
+            memcpy(chunk + cnt * 4, &net_idx, 4);
+        }
+        if (!frame_push(user.out, 9, up.id, chunk, cnt * 4))
+            return false;
+        up.need_sent += cnt;
+    }
+    if (!frame_push(user.out, 10, up.id, chunk, 0))
+        return false;
+    up.need_list.clear();
+    up.replied = true;
+    user.replies.pop();
+    return true;
+}
+
+bool send_reject(USER& user) {
+    pair<int, string>& reject = user.rejects.front();
+    if (!frame_push(user.out, 20, reject.first, reject.second.data(), reject.second.size()))
+        return false;
+    user.rejects.pop();
+    return true;
+}
+
+/*
+    Rejects and upload replies go first since the client is waiting on
+    them, then the running downloads take turns, one segment each, so a
+    small file is not stuck behind a big one. At most STREAM_QUANTUM bytes
+    per call, scaled by the folder's weight and cut to its download
+    tokens, keeps one connection from monopolizing the loop. Out of tokens
+    only rejects and upload replies go out. A cork taken by stream_segment() is released before
+    returning, so nothing waits for the cork timeout.
+*/
+void send_output(SERVER& server, USER& user) {
+    off_t budget = STREAM_QUANTUM;
+    if (user.folder != NULL) {
+        budget = budget * user.folder->weight / WEIGHT_DEFAULT;
+        if (!send_open(user))
+            budget = 0;
+        else if (user.folder->down.rate != 0 && user.folder->down.tokens < budget)
+            budget = user.folder->down.tokens;
+    }
+    if (budget == 0) {
+        while (user.seg == NULL && flush_output(server, user) && (!user.rejects.empty() || !user.replies.empty())) {
+            if (!user.rejects.empty())
+                send_reject(user);
+            else
+                send_reply(user, *user.replies.front());
+        }
+        return;
+    }
+
+    while (budget > 0 && flush_output(server, user)) {
+        if (user.seg != NULL) {
+            if (!stream_segment(server, user, budget))
+                break;
+            continue;
+        }
+
+        if (!user.rejects.empty()) {
+            send_reject(user);
+            continue;
+        }
+        if (!user.replies.empty()) {
+            send_reply(user, *user.replies.front());
+            continue;
+        }
+
+        start_downloads(server, user);
+        if (!ready_download(user)) {
+            flush_output(server, user);
             break;
         }
+
+        user.rr = (user.rr + 1) % user.downloads.size();
+        if (!step_download(server, user, user.rr, budget))
+            break;
     }
-    if (file_id == -1)
-        log_info(true, "[ERROR] change_file_state() error. no such file.\n");
+    if (user.corked && user.fd != -1)
+        set_cork(user, false);
+}
 
-    folders[folder_id].files[file_id].mode = mode;
+int shard_of(const char *name, int shard_cnt) {
+    return name_hash(name) % shard_cnt;
 }
 
-void user_exit(USER& user, vector<FOLDER>& folders) {
-    close(user.fd);
-    user.fd = -1;
-    
-    if (user.rd_fd != NULL) {
-        fclose(user.rd_fd);
-        user.rd_fd = NULL;
-        change_file_state(folders, user.name, user.rd_name, 0);
+/*
+    Moves a connection that logged into a username owned by another shard.
+    Everything on this side is detached before the push, after it the user
+    belongs to the target thread and must not be touched here.
+*/
+void handoff_user(SERVER& server, USER& user, SERVER& target) {
+    if (server.loop.backend != LOOP_URING && loop_del(server.loop, user.fd) == -1)
+        log_info(true, "[ERROR] loop_del() error.\n");
+    server.users[user.fd] = NULL;
+    user.can_read = true;
+    user.can_write = false;
+    user.rd_interest = true;
+    user.wr_interest = false;
+    server.stats.handoffs++;
+
+    USER *head = target.inbox.load(memory_order_relaxed);
+    do {
+        user.next = head;
+    } while (!target.inbox.compare_exchange_weak(head, &user, memory_order_release, memory_order_relaxed));
+
+    uint64_t one = 1;
+    if (write(target.event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        log_info(true, "[ERROR] eventfd write() error.\n");
+    log_trace("[INFO] hand off client to its shard.\n");
+}
+
+void drain_inbox(SERVER& server) {
+    uint64_t cnt;
+    while (read(server.event_fd, &cnt, sizeof(cnt)) > 0);
+
+    USER *list = server.inbox.exchange(NULL, memory_order_acquire), *fifo = NULL;
+    while (list != NULL) {
+        USER *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
     }
 
-    if (user.wr_fd != NULL) {
-        fclose(user.wr_fd);
-        user.wr_fd = NULL;
-        change_file_state(folders, user.name, user.wr_name, 0);
+    while (fifo != NULL) {
+        USER *user = fifo;
+        fifo = fifo->next;
+        if (server.loop.backend == LOOP_URING)
+            user->can_write = true;
+        else if (loop_add(server.loop, user->fd, EV_READ) == -1) {
+            log_info(false, "[INFO] loop_add() rejected client.\n");
+            close(user->fd);
+            delete user;
+            continue;
+        }
+        if ((int)server.users.size() <= user->fd)
+            server.users.resize(user->fd + 1, NULL);
+        server.users[user->fd] = user;
+        mark_active(server, user);
     }
 }
 
-bool is_user_exit(USER& user) {
-    return user.fd == -1;
+/*
+    Applies a finished io_uring read, write or poll of the user.
+*/
+void complete_io(SERVER& server, USER& user, EVENT& ev) {
+    if (ev.events & EV_RECV) {
+        user.recv_busy = false;
+        if (ev.res > 0) {
+            user.in.tail += ev.res;
+            user.stats.bytes_in += ev.res;
+        } else
+            user.eof = true;
+    }
+    if (ev.events & EV_SEND) {
+        user.send_busy = false;
+        if (ev.res > 0) {
+            user.out.head += ev.res;
+            user.stats.bytes_out += ev.res;
+            user.stall_since = 0;
+        } else {
+            user.out.head = user.out.tail;
+            user.eof = true;
+        }
+        user.can_write = buf_size(user.out) == 0;
+    }
+    if (ev.events & (EV_READ | EV_WRITE)) {
+        user.poll_busy = false;
+        user.can_write = true;
+    }
+
+    if (user.fd != -1)
+        mark_active(server, &user);
+    else if (!io_busy(user)) {
+        server.users[ev.fd] = NULL;
+        close(ev.fd);
+        delete &user;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2)
-        log_info(true, "[USAGE] <program> <port>\n");
+/*
+    Returns false if the user now belongs to another shard.
+*/
+bool serve_user(SERVER& server, USER& user) {
+    if (user.evict) {
+        drop_user(server, user, "[INFO] client stalled. drop client.\n");
+        return true;
+    }
+    if (user.disk_error) {
+        drop_user(server, user, "[INFO] disk error. drop client.\n");
+        return true;
+    }
+    if (user.can_read && recv_open(user))
+        recv_user(server, user);
 
-    int port;
-    if (sscanf(argv[1], "%d", &port) != 1 || port < 0)
-        log_info(true, "[ERROR] port must be a positive number.\n");
+    while (user.fd != -1 && !user.disk_wait) {
+        if (user.cur_case.mode == -1) {
+            int status = frame_pop(user.in, user.cur_case);
+            if (status == -1) {
+                drop_user(server, user, "[INFO] recv() bad frame. drop client.\n");
+                return true;
+            } else if (status == 0)
+                break;
+            user.stats.frames_in++;
+        }
+        if (user.cur_case.mode == 0 && user.folder == NULL && valid_name(user.cur_case)) {
+            int shard = shard_of(user.cur_case.buf, server.shards->size());
+            if (shard != server.id) {
+                handoff_user(server, user, *(*server.shards)[shard]);
+                return false;
+            }
+        }
+        handle_case(server, user);
+    }
+    if (user.fd == -1)
+        return true;
+
+    if (user.eof && user.cur_case.mode == -1) {
+        user_exit(server, user);
+        log_trace("[INFO] client exit.\n");
+        return true;
+    }
+
+    if (user.can_write)
+        send_output(server, user);
+    return true;
+}
+
+/*
+    Marks the users whose socket refused data for longer than the stall
+    timeout, dropping them in the next batch closes their downloads and
+    frees their queues.
+*/
+void sweep_stalled(SERVER& server, uint64_t now) {
+    for (int i = 0; i < server.users.size(); i++) {
+        USER *user = server.users[i];
+        if (user == NULL || user->fd == -1 || user->stall_since == 0 || now - user->stall_since < server.stall_us)
+            continue;
+        user->evict = true;
+        server.stats.evicted++;
+        mark_active(server, user);
+    }
+}
+
+/*
+    Rebuilds this shard's part of the stats text, one line per histogram
+    and one per connection.
+*/
+void publish_stats(SERVER& server) {
+    char line[256];
+    string report;
+    CONN_STATS total = server.stats.gone;
+    int cnt = 0;
+    for (int i = 0; i < server.users.size(); i++) {
+        USER *user = server.users[i];
+        if (user == NULL)
+            continue;
+        conn_stats_add(total, user->stats);
+        cnt++;
+
+        snprintf(line, sizeof(line), "user %d.%d %s rd_list %zu%s downloads %zu uploads %zu", server.id, user->fd,
+                 user->folder != NULL ? user->name : "-", user->rd_list.size(), user->overflow ? "+" : "", user->downloads.size(),
+                 user->uploads.size());
+        report += line;
+        conn_stats_format(report, user->stats);
+        report += "\n";
+    }
+
+    snprintf(line, sizeof(line), "shard %d users %d folders %zu loops %llu accepted %llu exited %llu evicted %llu handoffs %llu throttled %llu",
+             server.id, cnt, server.folders.size(), (unsigned long long)server.stats.loops, (unsigned long long)server.stats.accepted,
+             (unsigned long long)server.stats.exited, (unsigned long long)server.stats.evicted, (unsigned long long)server.stats.handoffs,
+             (unsigned long long)server.stats.throttled);
+    string head = line;
+    conn_stats_format(head, total);
+    snprintf(line, sizeof(line), "\n  cache files %d bytes %llu hits %llu misses %llu\n", server.cache_files,
+             (unsigned long long)server.cache_bytes, (unsigned long long)server.stats.cache_hits,
+             (unsigned long long)server.stats.cache_misses);
+    head += line;
+    hist_format(head, "  loop_us", server.stats.loop_us);
+    hist_format(head, "  upload_us", server.stats.upload_us);
+    hist_format(head, "  download_us", server.stats.download_us);
+    hist_format(head, "  disk_us", server.stats.disk_us);
+
+    lock_guard<mutex> guard(server.report_lock);
+    server.report = head + report;
+}
+
+/*
+    Answers every pending stats connection with the latest reports of all
+    shards and closes it. The send is blocking with a short timeout, the
+    reader is a local tool.
+*/
+void serve_stats(SERVER& server) {
+    while (true) {
+        int fd = accept(server.stats_fd, NULL, NULL);
+        if (fd == -1)
+            return;
+
+        string text;
+        for (int i = 0; i < server.shards->size(); i++) {
+            SERVER *shard = (*server.shards)[i];
+            lock_guard<mutex> guard(shard->report_lock);
+            text += shard->report;
+        }
+
+        timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        for (size_t off = 0; off < text.size();) {
+            ssize_t len = send(fd, text.data() + off, text.size() - off, MSG_NOSIGNAL);
+            if (len <= 0)
+                break;
+            off += len;
+        }
+        close(fd);
+    }
+}
+
+void setup_stats(SERVER& server, const char *path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        log_info(true, "[ERROR] stats socket path too long.\n");
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    server.stats_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.stats_fd == -1)
+        log_info(true, "[ERROR] socket() error.\n");
+    if (bind(server.stats_fd, (sockaddr *)&address, sizeof(address)) == -1)
+        log_info(true, "[ERROR] bind() stats socket error.\n");
+    if (listen(server.stats_fd, BACKLOG) == -1)
+        log_info(true, "[ERROR] listen() error.\n");
+    set_no_blocking(server.stats_fd);
+    if (loop_add(server.loop, server.stats_fd, EV_READ) == -1)
+        log_info(true, "[ERROR] loop_add() error.\n");
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1)
+void setup_server(SERVER& server, int port, int backend) {
+    server.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server.fd == -1)
         log_info(true, "[ERROR] socket() error.\n");
 
+    int on = 1;
+    if (setsockopt(server.fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        log_info(true, "[ERROR] setsockopt() SO_REUSEPORT error.\n");
+
     sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(port);
     inet_aton("127.0.0.1", &server_address.sin_addr);
 
-    if (bind(server_fd, (sockaddr *)&server_address, sizeof(server_address)) == -1)
+    if (bind(server.fd, (sockaddr *)&server_address, sizeof(server_address)) == -1)
         log_info(true, "[ERROR] bind() error.\n");
 
-    if (listen(server_fd, BACKLOG) == -1)
+    if (listen(server.fd, BACKLOG) == -1)
         log_info(true, "[ERROR] listen() error.\n");
 
-    set_no_blocking(server_fd);
+    set_no_blocking(server.fd);
 
-    vector<USER> clients;
-    vector<FOLDER> folders;
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server.event_fd == -1)
+        log_info(true, "[ERROR] eventfd() error.\n");
 
-    int max_fd = server_fd;
-    fd_set rd, rd_backup, wr, wr_backup;
-    FD_ZERO(&rd_backup);
-    FD_ZERO(&wr_backup);
-    FD_SET(server_fd, &rd_backup);
-    FD_SET(server_fd, &wr_backup);
+    if (loop_init(server.loop, backend) == -1)
+        log_info(true, "[ERROR] loop_init() error.\n");
+    if (loop_add(server.loop, server.fd, EV_READ) == -1 || loop_add(server.loop, server.event_fd, EV_READ) == -1)
+        log_info(true, "[ERROR] loop_add() error.\n");
+}
 
-    char path[100];
+void run_server(SERVER *shard) {
+    SERVER& server = *shard;
+    vector<EVENT> ready;
+    vector<USER *> batch;
     while (true) {
-        rd = rd_backup;
-        wr = wr_backup;
-
-        int status = select(max_fd + 1, &rd, &wr, NULL, NULL);
+        int timeout = 0;
+        if (server.active.empty()) {
+            uint64_t now = now_us(), next = server.next_sweep;
+            if (server.stats_on && server.next_report < next)
+                next = server.next_report;
+            if (server.next_refill < next)
+                next = server.next_refill;
+            timeout = now < next ? (next - now) / 1000 + 1 : 0;
+        }
+        int status = loop_wait(server.loop, ready, timeout);
         if (status < 0)
-            log_info(true, "[ERROR] select() error.\n");
-        else if (status > 0) {
-            if (FD_ISSET(server_fd, &rd)) {
-                int client_fd = accept(server_fd, NULL, NULL);
-                if (client_fd == -1) {
-                    if (errno == EAGAIN)
-                        log_info(false, "[INFO] accept() not finished.\n");
-                    else
-                        log_info(true, "[ERROR] accept() error.\n");
-                } else {
-                    log_info(false, "[INFO] accept() new client.\n");
-
-                    USER client;
-                    client.fd = client_fd;
-                    clients.push_back(client);
-
-                    FD_SET(client_fd, &rd_backup);
-                    FD_SET(client_fd, &wr_backup);
-                    max_fd = max(max_fd, client_fd);
-                }
+            log_info(true, "[ERROR] loop_wait() error.\n");
+        uint64_t start = now_us();
+        if (start >= server.next_refill)
+            wake_throttled(server);
+
+        for (int i = 0; i < ready.size(); i++) {
+            if (ready[i].fd == server.fd) {
+                accept_clients(server);
+                continue;
+            } else if (ready[i].fd == server.event_fd) {
+                drain_inbox(server);
+                drain_disk(server);
+                continue;
+            } else if (ready[i].fd == server.stats_fd) {
+                serve_stats(server);
+                continue;
             }
 
-            for (int i = 0; i < clients.size(); i++) {
-                if (clients[i].cur_case.mode != -1) {
-                    if (clients[i].cur_case.mode == 0) {
-                        strcpy(clients[i].name, clients[i].cur_case.buf);
-                        mkdir(clients[i].name, 0777);
-
-                        int folder_id = -1;
-                        for (int j = 0; j < folders.size(); j++) {
-                            if (!strcmp(clients[i].name, folders[j].name)) {
-                                folder_id = j;
-                                break;
-                            }
-                        }
-                        if (folder_id == -1)
-                            folders.push_back(FOLDER(clients[i].name));
-                        else {
-                            for (int j = 0; j < folders[folder_id].files.size(); j++) {
-                                char *file_name = new char(strlen(folders[folder_id].files[j].name) + 1);
-                                strcpy(file_name, folders[folder_id].files[j].name);
-                                clients[i].rd_list.push(file_name);
-                            }
-                        }
-
-                        clients[i].cur_case.mode = -1;
-                    } else if (clients[i].cur_case.mode == 1) {
-                        if (clients[i].wr_fd != NULL)
-                            continue;
-
-                        int folder_id = -1;
-                        for (int j = 0; j < folders.size(); j++) {
-                            if (!strcmp(clients[i].name, folders[j].name)) {
-                                folder_id = j;
-                                break;
-                            }
-                        }
-                        if (folder_id == -1)
-                            log_info(true, "[ERROR] recv mode 1 error. no such folder.\n");
-
-                        int file_id = -1;
-                        for (int j = 0; j < folders[folder_id].files.size(); j++) {
-                            if (!strcmp(clients[i].cur_case.buf, folders[folder_id].files[j].name)) {
-                                file_id = j;
-                                break;
-                            }
-                        }
-                        if (file_id != -1 && folders[folder_id].files[file_id].mode != 0)
-                            continue;
-                        
-                        strcpy(clients[i].wr_name, clients[i].cur_case.buf);
-                        if (file_id == -1)
-                            folders[folder_id].files.push_back(FILE_STATE(clients[i].wr_name, 2));
-                        strcpy(path, clients[i].name);
-                        strcat(path, "/");
-                        strcat(path, clients[i].wr_name);
-                        clients[i].wr_fd = fopen(path, "wb");
-
-                        clients[i].cur_case.mode = -1;
-                    } else if (clients[i].cur_case.mode == 2) {
-                        if (clients[i].wr_fd == NULL)
-                            log_info(true, "[ERROR] recv mode 2 error. no wr_fd.\n");
-
-                        if (clients[i].cur_case.len == 0) {
-                            fclose(clients[i].wr_fd);
-                            clients[i].wr_fd = NULL;
-                            change_file_state(folders, clients[i].name, clients[i].wr_name, 0);
-                            
-                            for (int j = 0; j < clients.size(); j++) {
-                                if (i == j || strcmp(clients[i].name, clients[j].name))
-                                    continue;
-                                char *file_name = new char(strlen(clients[i].wr_name) + 1);
-                                strcpy(file_name, clients[i].wr_name);
-                                clients[j].rd_list.push(file_name);
-                            }
-                        } else
-                            fwrite(clients[i].cur_case.buf, 1, clients[i].cur_case.len, clients[i].wr_fd);
-
-                        clients[i].cur_case.mode = -1;
-                    }
-                } else if (FD_ISSET(clients[i].fd, &rd)) {
-                    int len = recv(clients[i].fd, &clients[i].cur_case, sizeof(clients[i].cur_case), 0);
-                    if (len == -1) {
-                        if (errno == EAGAIN)
-                            log_info(false, "[INFO] recv() not finished.\n");
-                        else
-                            log_info(true, "[ERROR] recv() error.\n");
-                    } else if (len == 0) {
-                        FD_CLR(clients[i].fd, &rd_backup);
-                        FD_CLR(clients[i].fd, &wr_backup);
-
-                        user_exit(clients[i], folders);
-                        log_info(false, "[INFO] client exit.\n");
-                        continue;
-                    }
-                }
-
-                if (FD_ISSET(clients[i].fd, &wr)) {
-                    if (clients[i].rd_fd != NULL) {
-                        if (clients[i].up_package.mode == -1) {
-                            clients[i].up_package.mode = 2;
-                            clients[i].up_package.len = fread(clients[i].up_package.buf, 1, BUF_SIZE, clients[i].rd_fd);
-                        }
-
-                        int len = send(clients[i].fd, &clients[i].up_package, sizeof(clients[i].up_package), 0);
-                        if (len == -1) {
-                            if (errno == EAGAIN)
-                                log_info(false, "[INFO] send() not finished.\n");
-                            else
-                                log_info(true, "[ERROR] send() error.\n");
-                        } else if (clients[i].up_package.len == 0)  {
-                            fclose(clients[i].rd_fd);
-                            clients[i].rd_fd = NULL;
-                            change_file_state(folders, clients[i].name, clients[i].rd_name, 0);
-                        } else 
-                            clients[i].up_package.mode = -1;
-                    } else if (!clients[i].rd_list.empty()) {
-                        clients[i].up_package.mode = 1;
-                        clients[i].up_package.len = -1;
-                        strcpy(clients[i].up_package.buf, clients[i].rd_list.front());
-
-                        int len = send(clients[i].fd, &clients[i].up_package, sizeof(clients[i].up_package), 0);
-                        if (len == -1) {
-                            if (errno == EAGAIN)
-                                log_info(false, "[INFO] send() not finished.\n");
-                            else
-                                log_info(true, "[ERROR] send() error.\n");
-                        } else {
-                            strcpy(clients[i].rd_name, clients[i].rd_list.front());
-                            delete clients[i].rd_list.front();
-                            clients[i].rd_list.pop();
-
-                            strcpy(path, clients[i].name);
-                            strcat(path, "/");
-                            strcat(path, clients[i].rd_name);
-                            clients[i].rd_fd = fopen(path, "rb");
-
-                            change_file_state(folders, clients[i].name, clients[i].rd_name, 2);
-                            clients[i].up_package.mode = -1;
-                        }
-                    }
-                }
+            USER *user = ready[i].fd < server.users.size() ? server.users[ready[i].fd] : NULL;
+            if (user == NULL)
+                continue;
+            if (server.loop.backend == LOOP_URING) {
+                complete_io(server, *user, ready[i]);
+                continue;
+            }
+            if (ready[i].events & EV_READ)
+                user->can_read = true;
+            if (ready[i].events & EV_WRITE)
+                user->can_write = true;
+            mark_active(server, user);
+        }
+
+        batch.swap(server.active);
+        server.active.clear();
+        order_batch(server, batch);
+        for (int i = 0; i < batch.size(); i++) {
+            USER *user = batch[i];
+            user->active = false;
+
+            if (!serve_user(server, *user))
+                continue;
+            if (user->fd == -1) {
+                if (!io_busy(*user))
+                    delete user;
+                continue;
             }
+            charge_user(*user);
+            update_interest(server, *user);
+            if (has_work(*user))
+                mark_active(server, user);
+        }
+        batch.clear();
 
-            clients.erase(remove_if(clients.begin(), clients.end(), is_user_exit), clients.end());
+        if (start >= server.next_sweep) {
+            sweep_stalled(server, now_us());
+            server.next_sweep = start + SWEEP_INTERVAL * 1000;
+        }
+        server.stats.loops++;
+        hist_add(server.stats.loop_us, now_us() - start);
+        if (server.stats_on && start >= server.next_report) {
+            publish_stats(server);
+            server.next_report = start + STATS_INTERVAL * 1000;
         }
     }
+}
+
+/*
+    Reads a file the journal has no valid record for and chunks it the way
+    the client does.
+*/
+bool scan_file(JOURNAL_RECORD& rec) {
+    char path[100];
+    sprintf(path, "%s/%s", rec.folder.c_str(), rec.name.c_str());
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    CHUNKER chunker;
+    vector<char> block(SCAN_BLOCK);
+    ssize_t len;
+    rec.size = 0;
+    rec.hash = HASH_INIT;
+    rec.chunks.clear();
+    while ((len = read(fd, block.data(), SCAN_BLOCK)) > 0) {
+        chunker_feed(chunker, block.data(), len, rec.chunks);
+        rec.hash = hash_update(rec.hash, block.data(), len);
+        rec.size += len;
+    }
+    chunker_finish(chunker, rec.chunks);
+    close(fd);
+    return len == 0;
+}
+
+void scan_files(vector<JOURNAL_RECORD> *files, vector<size_t> *stale, atomic<size_t> *next) {
+    size_t i;
+    while ((i = next->fetch_add(1)) < stale->size()) {
+        JOURNAL_RECORD& rec = (*files)[(*stale)[i]];
+        if (!scan_file(rec))
+            rec.folder.clear();
+    }
+}
+
+/*
+    Runs before the shards start. Every file in the user directories is
+    taken from the journal when its size, inode and mtime still match the
+    last record of it, the rest (written while the server was down, or
+    published right before a crash) are chunked again by cnt threads. Stale
+    .part files are removed. The journal is then rewritten with one record
+    per file, which also drops a torn tail, and kept open for appends.
+*/
+void load_index(vector<SERVER *>& shards, JOURNAL& journal, int cnt) {
+    string data;
+    int fd = open(JOURNAL_PATH, O_RDONLY);
+    if (fd != -1) {
+        char block[64 * 1024];
+        ssize_t len;
+        while ((len = read(fd, block, sizeof(block))) > 0)
+            data.append(block, len);
+        close(fd);
+    }
+
+    unordered_map<string, JOURNAL_RECORD> known;
+    JOURNAL_RECORD rec;
+    size_t pos = 0;
+    while (journal_decode(data, pos, rec))
+        known[rec.folder + "/" + rec.name] = rec;
+    if (pos < data.size())
+        log_info(false, "[INFO] journal has a torn tail, dropped.\n");
+    data.clear();
+
+    vector<JOURNAL_RECORD> files;
+    vector<size_t> stale;
+    DIR *top = opendir(".");
+    if (top == NULL)
+        log_info(true, "[ERROR] opendir() error.\n");
+    dirent *ent;
+    while ((ent = readdir(top)) != NULL) {
+        struct stat st;
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) >= NAME_SIZE || stat(ent->d_name, &st) == -1 || !S_ISDIR(st.st_mode))
+            continue;
+        DIR *dir = opendir(ent->d_name);
+        if (dir == NULL)
+            continue;
+
+        dirent *file;
+        while ((file = readdir(dir)) != NULL) {
+            char path[NAME_SIZE + sizeof(file->d_name)];
+            size_t len = strlen(file->d_name);
+            sprintf(path, "%s/%s", ent->d_name, file->d_name);
+            if (file->d_name[0] == '.') {
+                if (len > 5 && !strcmp(file->d_name + len - 5, ".part"))
+                    unlink(path);
+                continue;
+            }
+            if (len >= NAME_SIZE || stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+                continue;
+
+            rec.folder = ent->d_name;
+            rec.name = file->d_name;
+            rec.ino = st.st_ino;
+            rec.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            unordered_map<string, JOURNAL_RECORD>::iterator it = known.find(rec.folder + "/" + rec.name);
+            if (it != known.end() && it->second.size == (uint64_t)st.st_size && it->second.ino == rec.ino && it->second.mtime == rec.mtime) {
+                files.push_back(it->second);
+                continue;
+            }
+            rec.chunks.clear();
+            stale.push_back(files.size());
+            files.push_back(rec);
+        }
+        closedir(dir);
+    }
+    closedir(top);
+    known.clear();
+
+    atomic<size_t> next(0);
+    vector<thread> threads;
+    for (int i = 0; i < cnt && i < stale.size(); i++)
+        threads.push_back(thread(scan_files, &files, &stale, &next));
+    for (int i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    string out;
+    fd = open(JOURNAL_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        log_info(true, "[ERROR] journal open error.\n");
+    for (int i = 0; i < files.size(); i++) {
+        JOURNAL_RECORD& file = files[i];
+        if (file.folder.empty())
+            continue;
+
+        char folder_name[NAME_SIZE], file_name[NAME_SIZE];
+        strcpy(folder_name, file.folder.c_str());
+        strcpy(file_name, file.name.c_str());
+        SERVER& server = *shards[shard_of(folder_name, shards.size())];
+        unordered_map<string, FOLDER>::iterator it = server.folders.find(file.folder);
+        if (it == server.folders.end()) {
+            it = server.folders.insert(make_pair(file.folder, FOLDER(folder_name))).first;
+            limit_folder(server, it->second);
+        }
+        FILE_STATE& state = it->second.files.insert(make_pair(file.name, FILE_STATE(file_name))).first->second;
+        state.size = file.size;
+        state.hash = file.hash;
+        state.chunks = file.chunks;
+
+        journal_encode(out, file);
+        if (out.size() >= SCAN_BLOCK) {
+            if (!write_all(fd, out.data(), out.size()))
+                log_info(true, "[ERROR] journal write error.\n");
+            out.clear();
+        }
+    }
+    if (!write_all(fd, out.data(), out.size()) || fsync(fd) == -1 || close(fd) == -1 || rename(JOURNAL_TMP, JOURNAL_PATH) == -1)
+        log_info(true, "[ERROR] journal rewrite error.\n");
+
+    journal.fd = open(JOURNAL_PATH, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (journal.fd == -1)
+        log_info(true, "[ERROR] journal open error.\n");
+
+    char msg[100];
+    sprintf(msg, "[INFO] loaded %zu files, %zu scanned.\n", files.size(), stale.size());
+    log_info(false, msg);
+}
+
+/*
+    Reads the -l table, one "<username or *> <weight> <upload KB/s>
+    <download KB/s>" per line, 0 is no limit and # starts a comment.
+*/
+void load_limits(const char *path, unordered_map<string, USER_LIMIT>& limits) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        log_info(true, "[ERROR] cannot open limits file.\n");
+
+    char line[256], name[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%255s", name) != 1)
+            continue;
+        USER_LIMIT limit;
+        unsigned long long up, down;
+        if (sscanf(line, "%255s %d %llu %llu", name, &limit.weight, &up, &down) != 4 || limit.weight < 1 || limit.weight > WEIGHT_MAX)
+            log_info(true, "[ERROR] bad line in limits file.\n");
+        limit.up_rate = up * 1024;
+        limit.down_rate = down * 1024;
+        limits[name] = limit;
+    }
+    fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+    const char *usage = "[USAGE] <program> <port> [-e epoll|select|uring] [-t threads] [-d disk threads] [-k stall seconds] [-b socket buffer KB] [-l limits file] [-s stats socket]\n";
+    if (argc < 2)
+        log_info(true, usage);
+
+    int port;
+    if (sscanf(argv[1], "%d", &port) != 1 || port < 0)
+        log_info(true, "[ERROR] port must be a positive number.\n");
+
+    int backend = LOOP_EPOLL, shard_cnt = 1, disk_cnt = DISK_THREADS, stall = STALL_TIMEOUT, sock_buf = 0;
+    const char *stats_path = NULL;
+    unordered_map<string, USER_LIMIT> limits;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "e:t:d:k:b:l:s:")) != -1) {
+        if (opt == 'e' && !strcmp(optarg, "epoll"))
+            backend = LOOP_EPOLL;
+        else if (opt == 'e' && !strcmp(optarg, "select"))
+            backend = LOOP_SELECT;
+        else if (opt == 'e' && !strcmp(optarg, "uring"))
+            backend = LOOP_URING;
+        else if (opt == 't' && sscanf(optarg, "%d", &shard_cnt) == 1 && shard_cnt > 0)
+            continue;
+        else if (opt == 'd' && sscanf(optarg, "%d", &disk_cnt) == 1 && disk_cnt > 0)
+            continue;
+        else if (opt == 'k' && sscanf(optarg, "%d", &stall) == 1 && stall > 0)
+            continue;
+        else if (opt == 'b' && sscanf(optarg, "%d", &sock_buf) == 1 && sock_buf > 0 && sock_buf <= 1024 * 1024)
+            continue;
+        else if (opt == 'l')
+            load_limits(optarg, limits);
+        else if (opt == 's')
+            stats_path = optarg;
+        else
+            log_info(true, usage);
+    }
+
+    DISK_POOL disk;
+    disk_init(disk, disk_cnt);
+    JOURNAL journal;
+
+    vector<SERVER *> shards;
+    for (int i = 0; i < shard_cnt; i++) {
+        SERVER *server = new SERVER();
+        server->id = i;
+        server->shards = &shards;
+        server->disk = &disk;
+        server->journal = &journal;
+        server->stall_us = (uint64_t)stall * 1000000;
+        server->sock_buf = sock_buf * 1024;
+        server->limits = limits.empty() ? NULL : &limits;
+        setup_server(*server, port, backend);
+        server->stats_on = stats_path != NULL;
+        shards.push_back(server);
+    }
+    if (stats_path != NULL)
+        setup_stats(*shards[0], stats_path);
+    load_index(shards, journal, disk_cnt);
+
+    vector<thread> threads;
+    for (int i = 1; i < shard_cnt; i++)
+        threads.push_back(thread(run_server, shards[i]));
+    run_server(shards[0]);
 
     return 0;
 }
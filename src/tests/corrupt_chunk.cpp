@@ -0,0 +1,224 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../protocol.h"
+#include "../chunker.h"
+using namespace std;
+
+/*
+    Used by test_corrupt_chunk.sh. Logs in as username with an empty
+    manifest, so the server starts sending down.bin, and uploads bad.bin
+    and good.bin on two streams at once. One chunk of bad.bin goes out with
+    a flipped byte. The server has to reject only that upload with a mode
+    20 frame while good.bin and the download finish. Other content under
+    the name bad.bin is then put and given up before any chunk, which has
+    to hand the kept chunks back. bad.bin is put again last and only the
+    chunks from the broken one on may be asked for. Writes what it sent
+    and got to the working directory and exits with 0 on success.
+*/
+struct TEST_UPLOAD {
+    int id;
+    string name, data;
+    vector<CHUNK> chunks;
+    vector<uint32_t> need;
+    bool listed;
+};
+
+int fd;
+BUFFER in, out;
+FILE *down_fp = NULL;
+bool down_done = false, rejected = false;
+
+void die(const char *msg) {
+    fprintf(stderr, "corrupt_chunk: %s\n", msg);
+    exit(1);
+}
+
+void flush_out() {
+    while (buf_size(out) > 0) {
+        if (buf_send(out, fd) <= 0)
+            die("send() error");
+    }
+}
+
+void begin_upload(TEST_UPLOAD& up) {
+    char sigs[BUF_SIZE];
+    frame_push(out, 1, up.id, up.name.data(), up.name.size());
+    for (size_t i = 0; i < up.chunks.size();) {
+        int cnt = 0;
+        for (; cnt < BUF_SIZE / SIG_SIZE && i < up.chunks.size(); cnt++, i++)
+            sig_put(sigs + cnt * SIG_SIZE, up.chunks[i]);
+        frame_push(out, 7, up.id, sigs, cnt * SIG_SIZE);
+        flush_out();
+    }
+    frame_push(out, 8, up.id, "", 0);
+    up.need.clear();
+    up.listed = false;
+    flush_out();
+}
+
+/*
+    Sends the chunks the server asked for, with the byte at flip turned
+    over if it is not -1.
+*/
+void send_chunks(TEST_UPLOAD& up, long flip) {
+    string data = up.data;
+    if (flip != -1)
+        data[flip] ^= 1;
+    for (size_t i = 0; i < up.need.size(); i++) {
+        CHUNK& c = up.chunks[up.need[i]];
+        for (uint32_t off = 0; off < c.len; off += BUF_SIZE) {
+            uint32_t len = c.len - off < BUF_SIZE ? c.len - off : BUF_SIZE;
+            frame_push(out, 2, up.id, data.data() + c.off + off, len);
+            flush_out();
+        }
+    }
+    frame_push(out, 2, up.id, "", 0);
+    flush_out();
+}
+
+void recv_more() {
+    ssize_t len = buf_recv(in, fd);
+    if (len == 0)
+        die("server closed the connection");
+    if (len == -1)
+        die("recv() error");
+}
+
+/*
+    Handles the next frame from the server, segment bodies are written to
+    down.bin.
+*/
+void handle_next(TEST_UPLOAD *ups, int cnt) {
+    PACKAGE pkg;
+    int res;
+    while ((res = frame_pop(in, pkg)) == 0)
+        recv_more();
+    if (res == -1)
+        die("bad frame");
+
+    if (pkg.mode == 13) {
+        for (uint32_t left = pkg.len; left > 0;) {
+            if (buf_size(in) == 0)
+                recv_more();
+            char chunk[BUF_SIZE * 16];
+            uint32_t len = buf_size(in) < left ? buf_size(in) : left;
+            len = len < sizeof(chunk) ? len : sizeof(chunk);
+            buf_read(in, chunk, len);
+            fwrite(chunk, 1, len, down_fp);
+            left -= len;
+        }
+    } else if (pkg.mode == 3) {
+        down_fp = fopen("down.bin", "wb");
+    } else if (pkg.mode == 2 && pkg.stream % 2 == 0) {
+        if (pkg.len != 0 || down_fp == NULL)
+            die("unexpected download data");
+        fclose(down_fp);
+        down_done = true;
+    } else if (pkg.mode == 20) {
+        if (pkg.stream != ups[0].id || strcmp(pkg.buf, ups[0].name.c_str()))
+            die("wrong upload rejected");
+        rejected = true;
+    } else if (pkg.mode == 9 || pkg.mode == 10) {
+        for (int i = 0; i < cnt; i++) {
+            if (ups[i].id != pkg.stream)
+                continue;
+            for (int j = 0; pkg.mode == 9 && j < pkg.len; j += 4) {
+                uint32_t net_idx;
+                memcpy(&net_idx, pkg.buf + j, 4);
+                ups[i].need.push_back(ntohl(net_idx));
+            }
+            ups[i].listed = pkg.mode == 10;
+        }
+    } else if (pkg.mode != 15)
+        die("unexpected frame");
+}
+
+void save_upload(TEST_UPLOAD& up) {
+    FILE *fp = fopen(up.name.c_str(), "wb");
+    fwrite(up.data.data(), 1, up.data.size(), fp);
+    fclose(fp);
+}
+
+void make_upload(TEST_UPLOAD& up, int id, const char *name, size_t size) {
+    up.id = id;
+    up.name = name;
+    up.data.resize(size);
+    for (size_t i = 0; i < size; i++)
+        up.data[i] = rand();
+    CHUNKER chunker;
+    up.chunks.clear();
+    chunker_feed(chunker, up.data.data(), size, up.chunks);
+    chunker_finish(chunker, up.chunks);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3)
+        die("usage: corrupt_chunk <port> <username>");
+    alarm(30);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[1]));
+    inet_aton("127.0.0.1", &addr.sin_addr);
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+        die("connect() error");
+
+    frame_push(out, 0, 0, argv[2], strlen(argv[2]));
+    limit_push(out, 0);
+    frame_push(out, 5, 0, "", 0);
+
+    TEST_UPLOAD ups[2];
+    srand(getpid());
+    make_upload(ups[0], 1, "bad.bin", 400000);
+    make_upload(ups[1], 3, "good.bin", 400000);
+    save_upload(ups[0]);
+    save_upload(ups[1]);
+    begin_upload(ups[0]);
+    begin_upload(ups[1]);
+    while (!ups[0].listed || !ups[1].listed)
+        handle_next(ups, 2);
+
+    /* the broken chunk is in the middle, everything after it is still sent */
+    size_t bad = ups[0].chunks.size() / 2;
+    send_chunks(ups[0], ups[0].chunks[bad].off + ups[0].chunks[bad].len / 2);
+    send_chunks(ups[1], -1);
+    while (!rejected || !down_done)
+        handle_next(ups, 2);
+
+    /* takes the kept chunks over and gives up before sending any */
+    TEST_UPLOAD other;
+    make_upload(other, 5, "bad.bin", 400000);
+    begin_upload(other);
+    while (!other.listed)
+        handle_next(&other, 1);
+    frame_push(out, 20, other.id, "", 0);
+    flush_out();
+
+    /* put again at once, the kept chunks must already be offered */
+    ups[0].id = 7;
+    begin_upload(ups[0]);
+    while (!ups[0].listed)
+        handle_next(ups, 1);
+    printf("retry needs %zu of %zu chunks\n", ups[0].need.size(), ups[0].chunks.size());
+    if (ups[0].need.size() != ups[0].chunks.size() - bad)
+        die("chunks before the broken one were not kept");
+    send_chunks(ups[0], -1);
+
+    /* the connection has to stay up, the server would close it on an error */
+    usleep(500000);
+    char byte;
+    if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || errno != EAGAIN)
+        die("server closed the connection");
+    return 0;
+}
@@ -0,0 +1,25 @@
+/*
+    Preloaded into the server by test_publish_fail.sh. A rename() onto a
+    path ending in $FAIL_RENAME waits two seconds and then fails, like the
+    publish of an upload on a broken disk.
+*/
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int rename(const char *from, const char *to) {
+    static int (*real)(const char *, const char *) = NULL;
+    const char *name = getenv("FAIL_RENAME");
+    size_t len = name != NULL ? strlen(name) : 0, to_len = strlen(to);
+    if (len > 0 && to_len >= len && strcmp(to + to_len - len, name) == 0) {
+        sleep(2);
+        errno = EIO;
+        return -1;
+    }
+    if (real == NULL)
+        real = (int (*)(const char *, const char *))dlsym(RTLD_NEXT, "rename");
+    return real(from, to);
+}
@@ -0,0 +1,45 @@
+# Shared by the tests: a scratch directory, a server on a random port and
+# clients that run in their own directories under it. Everything started
+# here is killed when the test exits.
+BIN=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+PORT=$((20000 + RANDOM % 20000))
+PIDS=""
+trap 'kill $PIDS 2>/dev/null; wait 2>/dev/null; rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+fail() {
+    echo "FAIL: $*"
+    for log in *.log; do
+        echo "--- $log"
+        tail -10 "$log"
+    done
+    exit 1
+}
+
+# start_server [server args...]
+start_server() {
+    mkdir -p srv
+    (cd srv && exec stdbuf -oL "$BIN/server" $PORT "$@" > ../srv.log 2>&1) &
+    PIDS="$PIDS $!"
+    sleep 0.3
+}
+
+# start_client <dir> <username> [client args...], runs in the background
+# without commands until the test ends
+start_client() {
+    local dir=$1 user=$2
+    shift 2
+    mkdir -p "$dir"
+    (cd "$dir" && exec stdbuf -oL "$BIN/client" 127.0.0.1 $PORT $user "$@" < /dev/null > "../$dir.log" 2>&1) &
+    PIDS="$PIDS $!"
+}
+
+# wait_same <file> <file>, up to 30 seconds
+wait_same() {
+    for i in $(seq 300); do
+        cmp -s "$1" "$2" && return 0
+        sleep 0.1
+    done
+    fail "$1 and $2 differ"
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# A chunk that fails its checksum rejects only its own upload. The other
+# upload and the download running on the same connection finish, the
+# session stays up and the upload's intact chunks are kept for the retry.
+. "$(dirname "$0")/lib.sh"
+
+g++ -O2 -o corrupt_chunk "$BIN/tests/corrupt_chunk.cpp" || fail "cannot build corrupt_chunk"
+mkdir -p srv/carol t
+head -c 2000000 /dev/urandom > srv/carol/down.bin
+start_server
+
+(cd t && ../corrupt_chunk $PORT carol) > t.log 2>&1 || fail "corrupt_chunk failed"
+wait_same t/good.bin srv/carol/good.bin
+wait_same t/bad.bin srv/carol/bad.bin
+cmp -s t/down.bin srv/carol/down.bin || fail "download did not finish"
+grep -q "upload rejected" srv.log || fail "upload not rejected"
+grep -q "drop client" srv.log && fail "client dropped"
+echo PASS
@@ -0,0 +1,23 @@
+#!/bin/bash
+# A delta download rebuilds the file from the client's old copy. Here that
+# copy was changed behind the server's back, so the rebuilt file does not
+# match its hash. The client drops it, asks for the file again with mode
+# 21 and gets the new version in full.
+. "$(dirname "$0")/lib.sh"
+
+mkdir -p srv/alice
+head -c 3000000 /dev/urandom > srv/alice/f.bin
+start_server
+start_client a alice -m
+start_client c alice
+wait_same srv/alice/f.bin a/f.bin
+wait_same srv/alice/f.bin c/f.bin
+
+printf 'changed behind the back' | dd of=a/f.bin bs=1 seek=100000 conv=notrunc 2> /dev/null
+printf 'changed in the middle' | dd of=c/f.bin bs=1 seek=1500000 conv=notrunc 2> /dev/null
+wait_same c/f.bin srv/alice/f.bin
+wait_same c/f.bin a/f.bin
+
+grep -q "f.bin Mismatch!" a.log || fail "delta did not use the changed copy"
+grep -q "drop client" srv.log && fail "client dropped"
+echo PASS
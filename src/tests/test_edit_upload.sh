@@ -0,0 +1,25 @@
+#!/bin/bash
+# A watched file is edited in place while its upload is held back by the
+# upload limit. The client finds the changed chunk when it reads it, gives
+# up that upload without sending stale bytes and puts the file again once
+# the debounce is over. The chunks that went out before the edit are kept
+# by the server, so the retry does not send the whole file again.
+. "$(dirname "$0")/lib.sh"
+
+echo "alice 1 1000 0" > limits
+start_server -l ../limits
+start_client a alice
+sleep 0.3
+head -c 8000000 /dev/urandom > a/f.bin
+sleep 1.5
+printf 'changed near the end' | dd of=a/f.bin bs=1 seek=7900000 conv=notrunc 2> /dev/null
+SECONDS=0
+wait_same a/f.bin srv/alice/f.bin
+# sending all of it again would take 8 seconds more at the limit
+[ $SECONDS -le 10 ] || fail "retry sent the whole file again"
+
+grep -q "f.bin Changed!" a.log || fail "edit not seen during upload"
+grep -q "upload rejected" srv.log && fail "stale chunk sent"
+grep -q "drop client" srv.log && fail "client dropped"
+kill -0 ${PIDS##* } 2>/dev/null || fail "client exited"
+echo PASS
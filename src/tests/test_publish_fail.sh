@@ -0,0 +1,20 @@
+#!/bin/bash
+# A publish that fails must not leave sessions behind. While the rename
+# of a new version hangs and then fails, a second session logs in and
+# skips the name, it still has to get the version already published.
+. "$(dirname "$0")/lib.sh"
+
+gcc -shared -fPIC -o fail_rename.so "$BIN/tests/fail_rename.c" -ldl || fail "cannot build fail_rename.so"
+mkdir -p srv/alice
+head -c 1000000 /dev/urandom > srv/alice/f.bin
+LD_PRELOAD=$WORK/fail_rename.so FAIL_RENAME=/f.bin start_server
+
+start_client a alice
+wait_same srv/alice/f.bin a/f.bin
+head -c 1000000 /dev/urandom > a/f.bin
+sleep 0.7
+start_client b alice -m
+wait_same srv/alice/f.bin b/f.bin
+
+grep -q "disk error" srv.log || fail "publish did not fail"
+echo PASS
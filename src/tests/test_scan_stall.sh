@@ -0,0 +1,18 @@
+#!/bin/bash
+# A large file is read and cut into chunks a budget at a time between the
+# loop passes. While one is still being read, a file another session
+# uploads has to arrive right away instead of after the whole read.
+. "$(dirname "$0")/lib.sh"
+
+start_server
+start_client a alice
+start_client b alice
+sleep 0.5
+truncate -s 2G a/huge.bin
+sleep 0.5
+echo "written while huge.bin is read" > b/small.txt
+SECONDS=0
+wait_same b/small.txt a/small.txt
+[ $SECONDS -le 2 ] || fail "download held up by the read"
+grep -q "huge.bin Start!" a.log && fail "huge.bin read before small.txt arrived"
+echo PASS
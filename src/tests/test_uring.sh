@@ -0,0 +1,26 @@
+#!/bin/bash
+# The io_uring backend on two shards: a watched file is written, then
+# edited in the middle, which uploads again and copies the unchanged
+# chunks from the old copy through the disk workers' rings. Sessions of
+# two usernames get every version.
+. "$(dirname "$0")/lib.sh"
+
+start_server -e uring -t 2
+start_client a alice
+start_client a2 alice -m
+start_client b bob
+start_client b2 bob -m
+sleep 0.3
+head -c 3000000 /dev/urandom > a/f.bin
+head -c 2000000 /dev/urandom > b/g.bin
+wait_same a/f.bin srv/alice/f.bin
+wait_same a/f.bin a2/f.bin
+wait_same b/g.bin b2/g.bin
+
+printf 'changed in the middle' | dd of=a/f.bin bs=1 seek=1500000 conv=notrunc 2> /dev/null
+wait_same a/f.bin srv/alice/f.bin
+wait_same a/f.bin a2/f.bin
+
+grep -q "ring setup error" srv.log && fail "disk ring not used"
+grep -q "drop client" srv.log && fail "client dropped"
+echo PASS